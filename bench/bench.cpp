@@ -0,0 +1,357 @@
+// Microbenchmarks of the core engines with deterministic synthetic workloads.
+//
+//   pg_cost_basis_bench [--filter substring] [--scale factor] [--json path]
+//
+// Every case generates its rows up front from a fixed seed, then times applying them to a fresh book.
+// Books allocate through CbCountingAllocator, so allocations and peak bytes are those of the engine only.
+// Results are printed as a table, --json also writes them as a JSON array for tracking regressions per commit.
+
+#include "acb0.h"
+#include "acb_book.h"
+#include "lot_book.h"
+#include "lot_policies.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct CbAllocationStats
+{
+    size_t mAllocations = 0;
+    size_t mBytes = 0;
+    size_t mPeakBytes = 0;
+};
+
+CbAllocationStats gStats;
+
+// std::allocator that counts allocations and live bytes in gStats
+template<typename T>
+struct CbCountingAllocator
+{
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    CbCountingAllocator() = default;
+    template<typename U> CbCountingAllocator(const CbCountingAllocator<U>&) noexcept {}
+
+    [[nodiscard]] T* allocate(std::size_t n)
+    {
+        ++gStats.mAllocations;
+        gStats.mBytes += n * sizeof(T);
+        gStats.mPeakBytes = std::max(gStats.mPeakBytes, gStats.mBytes);
+        return std::allocator<T>{}.allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        gStats.mBytes -= n * sizeof(T);
+        std::allocator<T>{}.deallocate(p, n);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const CbCountingAllocator<T>&, const CbCountingAllocator<U>&) { return true; }
+
+template<typename T, typename U>
+bool operator!=(const CbCountingAllocator<T>&, const CbCountingAllocator<U>&) { return false; }
+
+using Allocator = CbCountingAllocator<char>;
+
+enum class RowKind : uint8_t
+{
+    Trade,
+    TransferOut,
+    TransferIn,
+};
+
+struct Row
+{
+    RowKind mKind;
+    AccountId mAccount;
+    AccountId mOtherAccount;
+    double mPrice;
+    double mAmount;
+    int64_t mTag;
+};
+
+struct CbBenchResult
+{
+    std::string mName;
+    size_t mRows = 0;
+    double mNsPerRow = 0.0;
+    double mAllocationsPerRow = 0.0;
+    size_t mPeakBytes = 0;
+    // Sum of capital gains, changes when the results of the engine change
+    double mChecksum = 0.0;
+};
+
+[[nodiscard]] double randomPrice(std::mt19937_64& rng)
+{
+    return 100.0 + static_cast<double>(rng() % 10000) / 100.0;
+}
+
+// Buys and sells of random size on one account, the balance stays non-negative
+[[nodiscard]] std::vector<Row> buySellRows(size_t numRows, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<Row> rows;
+    rows.reserve(numRows);
+    double balance = 0.0;
+    for (size_t i = 0; i < numRows; ++i)
+    {
+        double amount = static_cast<double>(rng() % 1000 + 1) / 100.0;
+        if (rng() % 2 == 0 && balance > amount)
+            amount = -amount;
+        balance += amount;
+        rows.push_back(Row{RowKind::Trade, 0, 0, randomPrice(rng), amount, static_cast<int64_t>(i)});
+    }
+    return rows;
+}
+
+// Dollar cost averaging: numLots tiny buys, then sells that consume thousands of lots each
+[[nodiscard]] std::vector<Row> dcaRows(size_t numLots, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<Row> rows;
+    rows.reserve(numLots + numLots / 1000 + 1);
+    for (size_t i = 0; i < numLots; ++i)
+        rows.push_back(Row{RowKind::Trade, 0, 0, randomPrice(rng), 0.001, static_cast<int64_t>(rows.size())});
+
+    double remaining = 0.001 * static_cast<double>(numLots);
+    while (remaining > 1e-6)
+    {
+        double amount = std::min(remaining, static_cast<double>(rng() % 4000 + 1000) * 0.001);
+        remaining -= amount;
+        rows.push_back(Row{RowKind::Trade, 0, 0, randomPrice(rng), -amount, static_cast<int64_t>(rows.size())});
+    }
+    return rows;
+}
+
+// Sweeps of numPending withdrawals between accounts that all stay pending, then their deposits in random order
+[[nodiscard]] std::vector<Row> transferSweepRows(size_t numSweeps, size_t numPending, uint64_t seed)
+{
+    constexpr AccountId NUM_ACCOUNTS = 16;
+
+    std::mt19937_64 rng(seed);
+    std::vector<Row> rows;
+    rows.reserve(NUM_ACCOUNTS + numSweeps * numPending * 2);
+    for (AccountId account = 0; account < NUM_ACCOUNTS; ++account)
+        rows.push_back(Row{RowKind::Trade, account, 0, randomPrice(rng), 1e6, static_cast<int64_t>(rows.size())});
+
+    std::vector<Row> deposits;
+    for (size_t sweep = 0; sweep < numSweeps; ++sweep)
+    {
+        deposits.clear();
+        for (size_t i = 0; i < numPending; ++i)
+        {
+            AccountId from = static_cast<AccountId>(rng() % NUM_ACCOUNTS);
+            AccountId to = static_cast<AccountId>((from + 1 + rng() % (NUM_ACCOUNTS - 1)) % NUM_ACCOUNTS);
+            double amount = static_cast<double>(rng() % 100000 + 1) / 1000.0;
+            rows.push_back(Row{RowKind::TransferOut, from, to, 0.0, -amount, static_cast<int64_t>(rows.size())});
+            deposits.push_back(Row{RowKind::TransferIn, to, from, 0.0, amount, 0});
+        }
+
+        std::shuffle(deposits.begin(), deposits.end(), rng);
+        for (Row& deposit : deposits)
+        {
+            deposit.mTag = static_cast<int64_t>(rows.size());
+            rows.push_back(deposit);
+        }
+    }
+    return rows;
+}
+
+// Random trades over numAccounts accounts
+[[nodiscard]] std::vector<Row> manyAccountsRows(size_t numRows, AccountId numAccounts, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<Row> rows;
+    rows.reserve(numRows);
+    std::vector<double> balances(numAccounts, 0.0);
+    for (size_t i = 0; i < numRows; ++i)
+    {
+        AccountId account = static_cast<AccountId>(rng() % numAccounts);
+        double amount = static_cast<double>(rng() % 1000 + 1) / 100.0;
+        if (rng() % 2 == 0 && balances[account] > amount)
+            amount = -amount;
+        balances[account] += amount;
+        rows.push_back(Row{RowKind::Trade, account, 0, randomPrice(rng), amount, static_cast<int64_t>(i)});
+    }
+    return rows;
+}
+
+// Time applyRows(rows) that returns the checksum
+template<typename ApplyRows>
+[[nodiscard]] CbBenchResult measure(const std::string& name, const std::vector<Row>& rows, ApplyRows&& applyRows)
+{
+    gStats = CbAllocationStats{};
+
+    auto start = std::chrono::steady_clock::now();
+    double checksum = applyRows(rows);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    CbBenchResult result;
+    result.mName = name;
+    result.mRows = rows.size();
+    result.mNsPerRow = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / static_cast<double>(rows.size());
+    result.mAllocationsPerRow = static_cast<double>(gStats.mAllocations) / static_cast<double>(rows.size());
+    result.mPeakBytes = gStats.mPeakBytes;
+    result.mChecksum = checksum;
+    return result;
+}
+
+[[nodiscard]] double runAcb0(const std::vector<Row>& rows)
+{
+    CbAcb0State state{ACB0_INITIAL_COST_BASIS, ACB0_INITIAL_COST_BASIS, ACB0_INITIAL_BALANCE, ACB0_INITIAL_BALANCE, 0.0};
+    double checksum = 0.0;
+    for (const Row& row : rows)
+    {
+        state = acb0Step(state.mCostBasisAfter, state.mBalanceAfter, row.mPrice, row.mAmount);
+        checksum += state.mCapitalGain;
+    }
+    return checksum;
+}
+
+[[nodiscard]] double runAcb(const std::vector<Row>& rows)
+{
+    CbAcbBook<Allocator> book;
+    double checksum = 0.0;
+    for (const Row& row : rows)
+    {
+        CbAcbRow out;
+        switch (row.mKind)
+        {
+        case RowKind::Trade:
+            book.realize(row.mAccount, row.mPrice, row.mAmount, out);
+            break;
+        case RowKind::TransferOut:
+            book.initiateTransfer(row.mAccount, row.mOtherAccount, std::nullopt, row.mAmount, std::nullopt, row.mTag, out);
+            break;
+        case RowKind::TransferIn:
+            book.finalizeTransfer(row.mAccount, row.mOtherAccount, std::nullopt, row.mAmount, row.mTag, out);
+            break;
+        }
+        checksum += out.mCapitalGain;
+    }
+    return checksum;
+}
+
+template<typename Policy>
+[[nodiscard]] double runLots(const std::vector<Row>& rows)
+{
+    CbLotBook<Policy, Allocator> book;
+    // Realized entries of a row are consumed before the next one, as in a plain aggregate
+    CbVector<CbLotEntry, Allocator> realized;
+    double checksum = 0.0;
+    for (const Row& row : rows)
+    {
+        realized.clear();
+        switch (row.mKind)
+        {
+        case RowKind::Trade:
+            book.realize(row.mAccount, row.mPrice, row.mAmount, row.mTag, realized);
+            break;
+        case RowKind::TransferOut:
+            book.initiateTransfer(row.mAccount, row.mOtherAccount, std::nullopt, row.mAmount, std::nullopt, row.mTag);
+            break;
+        case RowKind::TransferIn:
+            book.finalizeTransfer(row.mAccount, row.mOtherAccount, std::nullopt, row.mAmount, row.mTag, realized);
+            break;
+        }
+        for (const CbLotEntry& entry : realized)
+            checksum += entry.mAmount * (row.mPrice - entry.mCostBasis);
+    }
+    return checksum;
+}
+
+struct CbBenchCase
+{
+    const char* mName;
+    std::function<CbBenchResult(double scale)> mRun;
+};
+
+[[nodiscard]] size_t scaled(size_t n, double scale)
+{
+    return std::max<size_t>(1, static_cast<size_t>(static_cast<double>(n) * scale));
+}
+
+const CbBenchCase BENCH_CASES[] = {
+    {"acb0_buy_sell", [](double scale) { return measure("acb0_buy_sell", buySellRows(scaled(10'000'000, scale), 1), runAcb0); }},
+    {"acb_buy_sell", [](double scale) { return measure("acb_buy_sell", buySellRows(scaled(5'000'000, scale), 1), runAcb); }},
+    {"fifo_buy_sell", [](double scale) { return measure("fifo_buy_sell", buySellRows(scaled(5'000'000, scale), 1), runLots<CbFifoPolicy>); }},
+    {"fifo_dca_1m_lots", [](double scale) { return measure("fifo_dca_1m_lots", dcaRows(scaled(1'000'000, scale), 2), runLots<CbFifoPolicy>); }},
+    {"acb_transfer_sweep", [](double scale) { return measure("acb_transfer_sweep", transferSweepRows(scaled(100, scale), 5000, 3), runAcb); }},
+    {"fifo_transfer_sweep", [](double scale) { return measure("fifo_transfer_sweep", transferSweepRows(scaled(100, scale), 5000, 3), runLots<CbFifoPolicy>); }},
+    {"acb_many_accounts", [](double scale) { return measure("acb_many_accounts", manyAccountsRows(scaled(5'000'000, scale), 100'000, 4), runAcb); }},
+    {"fifo_many_accounts", [](double scale) { return measure("fifo_many_accounts", manyAccountsRows(scaled(5'000'000, scale), 100'000, 4), runLots<CbFifoPolicy>); }},
+};
+
+void writeJson(const char* path, const std::vector<CbBenchResult>& results)
+{
+    FILE* file = std::fopen(path, "w");
+    if (file == nullptr)
+    {
+        std::perror(path);
+        std::exit(1);
+    }
+
+    std::fprintf(file, "[\n");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const CbBenchResult& r = results[i];
+        std::fprintf(file, "  {\"name\": \"%s\", \"rows\": %zu, \"ns_per_row\": %.3f, \"allocations_per_row\": %.6f, \"peak_bytes\": %zu, \"checksum\": %.17g}%s\n",
+                     r.mName.c_str(), r.mRows, r.mNsPerRow, r.mAllocationsPerRow, r.mPeakBytes, r.mChecksum, i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(file, "]\n");
+    std::fclose(file);
+}
+
+} // namespace {
+
+int main(int argc, char** argv)
+{
+    const char* filter = nullptr;
+    const char* jsonPath = nullptr;
+    double scale = 1.0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+            scale = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            jsonPath = argv[++i];
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--filter substring] [--scale factor] [--json path]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<CbBenchResult> results;
+    std::printf("%-22s %12s %10s %12s %14s\n", "case", "rows", "ns/row", "allocs/row", "peak bytes");
+    for (const CbBenchCase& benchCase : BENCH_CASES)
+    {
+        if (filter != nullptr && std::strstr(benchCase.mName, filter) == nullptr)
+            continue;
+
+        CbBenchResult r = benchCase.mRun(scale);
+        std::printf("%-22s %12zu %10.2f %12.4f %14zu\n", r.mName.c_str(), r.mRows, r.mNsPerRow, r.mAllocationsPerRow, r.mPeakBytes);
+        std::fflush(stdout);
+        results.push_back(std::move(r));
+    }
+
+    if (jsonPath != nullptr)
+        writeJson(jsonPath, results);
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+-- Deterministic synthetic trades for the SQL benchmarks, see run.sh
+--
+-- cb_bench_generate(rows, accounts, seed) fills cb_bench_trades with buys, sells and transfers between accounts.
+-- Amounts are multiples of 0.001, balances never go negative, transfers have a transfer_id and their deposit
+-- immediately follows the withdrawal.
+
+CREATE UNLOGGED TABLE IF NOT EXISTS cb_bench_trades (
+    tag bigint PRIMARY KEY,
+    account text NOT NULL,
+    dest_account text,
+    price float,
+    amount float NOT NULL,
+    transfer_id text
+);
+
+CREATE OR REPLACE FUNCTION cb_bench_generate(num_rows bigint, num_accounts int, seed float)
+    RETURNS void
+    LANGUAGE plpgsql
+AS $$
+DECLARE
+    -- balances in thousandths, exact
+    balances bigint[] := array_fill(0::bigint, ARRAY[num_accounts]);
+    tags bigint[] := '{}';
+    accounts text[] := '{}';
+    dest_accounts text[] := '{}';
+    prices float[] := '{}';
+    amounts float[] := '{}';
+    transfer_ids text[] := '{}';
+    tag bigint := 0;
+    src int;
+    dst int;
+    milli bigint;
+    r float;
+    price float;
+BEGIN
+    TRUNCATE cb_bench_trades;
+    PERFORM setseed(seed);
+
+    WHILE tag < num_rows LOOP
+        src := 1 + floor(random() * num_accounts)::int;
+        milli := 1 + floor(random() * 10000)::bigint;
+        price := round((100.0 + random() * 100.0)::numeric, 2)::float;
+        r := random();
+
+        IF r < 0.05 AND num_accounts > 1 AND balances[src] >= milli AND tag + 2 <= num_rows THEN
+            dst := 1 + (src + floor(random() * (num_accounts - 1))::int) % num_accounts;
+            balances[src] := balances[src] - milli;
+            balances[dst] := balances[dst] + milli;
+
+            tags := tags || ARRAY[tag + 1, tag + 2];
+            accounts := accounts || ARRAY['acct_' || src, 'acct_' || dst];
+            dest_accounts := dest_accounts || ARRAY['acct_' || dst, 'acct_' || src];
+            prices := prices || ARRAY[NULL::float, NULL::float];
+            amounts := amounts || ARRAY[-milli / 1000.0, milli / 1000.0]::float[];
+            transfer_ids := transfer_ids || ARRAY['tx_' || (tag + 1), 'tx_' || (tag + 1)];
+            tag := tag + 2;
+        ELSE
+            IF r >= 0.5 OR balances[src] < milli THEN
+                balances[src] := balances[src] + milli;
+            ELSE
+                balances[src] := balances[src] - milli;
+                milli := -milli;
+            END IF;
+
+            tags := tags || (tag + 1);
+            accounts := accounts || ('acct_' || src);
+            dest_accounts := dest_accounts || NULL::text;
+            prices := prices || price;
+            amounts := amounts || (milli / 1000.0)::float;
+            transfer_ids := transfer_ids || NULL::text;
+            tag := tag + 1;
+        END IF;
+
+        IF cardinality(tags) >= 100000 OR tag >= num_rows THEN
+            INSERT INTO cb_bench_trades
+            SELECT * FROM unnest(tags, accounts, dest_accounts, prices, amounts, transfer_ids);
+            tags := '{}';
+            accounts := '{}';
+            dest_accounts := '{}';
+            prices := '{}';
+            amounts := '{}';
+            transfer_ids := '{}';
+        END IF;
+    END LOOP;
+
+    ANALYZE cb_bench_trades;
+END
+$$;
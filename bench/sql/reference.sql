@@ -0,0 +1,189 @@
+-- Reference PL/pgSQL implementations of ACB0, ACB and FIFO, see run.sh
+--
+-- They read cb_bench_trades in tag order and repeat the arithmetic of the engines operation by operation,
+-- so their outputs are expected to match the aggregates. Only what the generator produces is supported:
+-- balances that never go negative and transfers matched by transfer_id.
+
+-- Balances closer to 0 are 0, AMOUNT_EPSILON of the engines
+CREATE OR REPLACE FUNCTION cb_ref_snap(amount float)
+    RETURNS float
+    LANGUAGE sql IMMUTABLE
+AS $$
+    SELECT CASE WHEN abs(amount) < 1e-11 THEN 0.0::float ELSE amount END
+$$;
+
+CREATE OR REPLACE FUNCTION cb_ref_acb0()
+    RETURNS TABLE (tag bigint, capital_gain float, balance_after float, cost_basis_after float)
+    LANGUAGE plpgsql
+AS $$
+DECLARE
+    t record;
+    cost_basis float := 1.0;
+    balance float := 0.0;
+    amount float;
+    new_balance float;
+BEGIN
+    FOR t IN SELECT * FROM cb_bench_trades ORDER BY cb_bench_trades.tag LOOP
+        -- transfers are ignored
+        amount := CASE WHEN t.dest_account IS NULL THEN t.amount ELSE 0.0 END;
+        tag := t.tag;
+        capital_gain := 0.0;
+
+        IF amount <> 0.0 THEN
+            new_balance := cb_ref_snap(balance + amount);
+            IF (balance < 0.0) = (amount < 0.0) THEN
+                -- open or increase position
+                IF new_balance <> 0.0 THEN
+                    cost_basis := (cost_basis * balance + t.price * amount) / new_balance;
+                END IF;
+            ELSIF (balance < 0.0) <> (new_balance < 0.0) THEN
+                -- close position and cross 0
+                capital_gain := balance * (t.price - cost_basis);
+                cost_basis := t.price;
+            ELSE
+                -- close position and do not cross 0
+                capital_gain := amount * (cost_basis - t.price);
+            END IF;
+            balance := new_balance;
+        END IF;
+
+        balance_after := balance;
+        cost_basis_after := cost_basis;
+        RETURN NEXT;
+    END LOOP;
+END
+$$;
+
+CREATE OR REPLACE FUNCTION cb_ref_acb()
+    RETURNS TABLE (tag bigint, capital_gain float, balance_after float, cost_basis_after float)
+    LANGUAGE plpgsql
+AS $$
+DECLARE
+    t record;
+    entry_cost_basis float;
+    entry_amount float;
+    transfer record;
+    new_balance float;
+    new_cost_basis float;
+    price float;
+BEGIN
+    CREATE TEMP TABLE IF NOT EXISTS cb_ref_acb_accounts (account text PRIMARY KEY, cost_basis float, amount float);
+    CREATE TEMP TABLE IF NOT EXISTS cb_ref_acb_transfers (transfer_id text PRIMARY KEY, cost_basis float, amount float);
+    TRUNCATE cb_ref_acb_accounts, cb_ref_acb_transfers;
+
+    FOR t IN SELECT * FROM cb_bench_trades ORDER BY cb_bench_trades.tag LOOP
+        SELECT a.cost_basis, a.amount INTO entry_cost_basis, entry_amount FROM cb_ref_acb_accounts a WHERE a.account = t.account;
+        IF NOT FOUND THEN
+            INSERT INTO cb_ref_acb_accounts VALUES (t.account, 1.0, 0.0);
+            entry_cost_basis := 1.0;
+            entry_amount := 0.0;
+        END IF;
+
+        tag := t.tag;
+        capital_gain := 0.0;
+        new_balance := cb_ref_snap(entry_amount + t.amount);
+        new_cost_basis := entry_cost_basis;
+        price := t.price;
+
+        IF t.dest_account IS NOT NULL AND t.amount < 0.0 THEN
+            -- withdrawal, the transfer carries the cost basis
+            INSERT INTO cb_ref_acb_transfers VALUES (t.transfer_id, entry_cost_basis, -t.amount);
+        ELSE
+            IF t.dest_account IS NOT NULL THEN
+                -- deposit, acquired at the cost basis of the withdrawal
+                DELETE FROM cb_ref_acb_transfers tr WHERE tr.transfer_id = t.transfer_id RETURNING tr.cost_basis, tr.amount INTO transfer;
+                price := transfer.cost_basis;
+            END IF;
+
+            IF (entry_amount < 0.0) = (t.amount < 0.0) THEN
+                IF new_balance <> 0.0 THEN
+                    new_cost_basis := (entry_cost_basis * entry_amount + price * t.amount) / new_balance;
+                END IF;
+            ELSIF (entry_amount < 0.0) <> (new_balance < 0.0) THEN
+                capital_gain := entry_amount * (price - entry_cost_basis);
+                new_cost_basis := price;
+            ELSE
+                capital_gain := t.amount * (entry_cost_basis - price);
+            END IF;
+        END IF;
+
+        UPDATE cb_ref_acb_accounts a SET cost_basis = new_cost_basis, amount = new_balance WHERE a.account = t.account;
+
+        balance_after := new_balance;
+        cost_basis_after := new_cost_basis;
+        RETURN NEXT;
+    END LOOP;
+END
+$$;
+
+CREATE OR REPLACE FUNCTION cb_ref_fifo()
+    RETURNS TABLE (tag bigint, capital_gain float)
+    LANGUAGE plpgsql
+AS $$
+DECLARE
+    t record;
+    lot record;
+    remaining float;
+    next_seq bigint := 0;
+BEGIN
+    CREATE TEMP TABLE IF NOT EXISTS cb_ref_fifo_lots (account text, seq bigint, lot_tag bigint, cost_basis float, amount float, PRIMARY KEY (account, seq));
+    CREATE TEMP TABLE IF NOT EXISTS cb_ref_fifo_transfers (transfer_id text, seq bigint, lot_tag bigint, cost_basis float, amount float, PRIMARY KEY (transfer_id, seq));
+    TRUNCATE cb_ref_fifo_lots, cb_ref_fifo_transfers;
+
+    FOR t IN SELECT * FROM cb_bench_trades ORDER BY cb_bench_trades.tag LOOP
+        tag := t.tag;
+        capital_gain := 0.0;
+
+        IF t.dest_account IS NOT NULL AND t.amount < 0.0 THEN
+            -- withdrawal, whole lots move to the transfer in order, the boundary lot is split
+            remaining := -t.amount;
+            FOR lot IN SELECT l.seq, l.lot_tag, l.cost_basis, l.amount FROM cb_ref_fifo_lots l WHERE l.account = t.account ORDER BY l.seq LOOP
+                EXIT WHEN remaining < 1e-11;
+                next_seq := next_seq + 1;
+                IF remaining > lot.amount THEN
+                    remaining := remaining - lot.amount;
+                    INSERT INTO cb_ref_fifo_transfers VALUES (t.transfer_id, next_seq, lot.lot_tag, lot.cost_basis, lot.amount);
+                    DELETE FROM cb_ref_fifo_lots l WHERE l.account = t.account AND l.seq = lot.seq;
+                ELSE
+                    INSERT INTO cb_ref_fifo_transfers VALUES (t.transfer_id, next_seq, lot.lot_tag, lot.cost_basis, remaining);
+                    IF lot.amount - remaining < 1e-11 THEN
+                        DELETE FROM cb_ref_fifo_lots l WHERE l.account = t.account AND l.seq = lot.seq;
+                    ELSE
+                        UPDATE cb_ref_fifo_lots l SET amount = lot.amount - remaining WHERE l.account = t.account AND l.seq = lot.seq;
+                    END IF;
+                    remaining := 0.0;
+                END IF;
+            END LOOP;
+        ELSIF t.dest_account IS NOT NULL THEN
+            -- deposit, transferred lots are appended in order
+            FOR lot IN DELETE FROM cb_ref_fifo_transfers tr WHERE tr.transfer_id = t.transfer_id RETURNING tr.seq, tr.lot_tag, tr.cost_basis, tr.amount LOOP
+                INSERT INTO cb_ref_fifo_lots VALUES (t.account, lot.seq, lot.lot_tag, lot.cost_basis, lot.amount);
+            END LOOP;
+        ELSIF t.amount > 0.0 THEN
+            next_seq := next_seq + 1;
+            INSERT INTO cb_ref_fifo_lots VALUES (t.account, next_seq, t.tag, t.price, t.amount);
+        ELSE
+            -- sell, lots are matched in order of acquisition
+            remaining := t.amount;
+            FOR lot IN SELECT l.seq, l.cost_basis, l.amount FROM cb_ref_fifo_lots l WHERE l.account = t.account ORDER BY l.seq LOOP
+                EXIT WHEN abs(remaining) < 1e-11;
+                IF lot.amount + remaining >= 0.0 THEN
+                    capital_gain := capital_gain - remaining * (t.price - lot.cost_basis);
+                    IF abs(lot.amount + remaining) < 1e-11 THEN
+                        DELETE FROM cb_ref_fifo_lots l WHERE l.account = t.account AND l.seq = lot.seq;
+                    ELSE
+                        UPDATE cb_ref_fifo_lots l SET amount = lot.amount + remaining WHERE l.account = t.account AND l.seq = lot.seq;
+                    END IF;
+                    remaining := 0.0;
+                ELSE
+                    capital_gain := capital_gain + lot.amount * (t.price - lot.cost_basis);
+                    remaining := remaining + lot.amount;
+                    DELETE FROM cb_ref_fifo_lots l WHERE l.account = t.account AND l.seq = lot.seq;
+                END IF;
+            END LOOP;
+        END IF;
+
+        RETURN NEXT;
+    END LOOP;
+END
+$$;
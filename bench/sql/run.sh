@@ -0,0 +1,158 @@
+#!/usr/bin/env bash
+# SQL level benchmarks of cb_acb0, cb_acb and cb_fifo window queries against the PL/pgSQL references of reference.sql.
+#
+#   bench/sql/run.sh [--rows "1000000 10000000"] [--accounts 100] [--output results.csv]
+#                    [--baseline results.csv] [--max-regression 0.2]
+#
+# Runs against a throwaway cluster created with initdb of pg_config, the extension must be installed there.
+# Every query runs in its own backend, peak memory is the VmHWM of that backend (Linux only, includes touched shared buffers).
+# The run fails when the outputs of the aggregates and the references differ, when an aggregate is slower than its
+# reference or, with --baseline, when rows/s of an aggregate dropped by more than --max-regression.
+
+set -euo pipefail
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+ROWS="1000000 10000000"
+ACCOUNTS=100
+OUTPUT=sql-bench-results.csv
+BASELINE=
+MAX_REGRESSION=0.2
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --rows) ROWS="$2"; shift 2 ;;
+        --accounts) ACCOUNTS="$2"; shift 2 ;;
+        --output) OUTPUT="$2"; shift 2 ;;
+        --baseline) BASELINE="$2"; shift 2 ;;
+        --max-regression) MAX_REGRESSION="$2"; shift 2 ;;
+        *) sed -n '2,10p' "$0"; exit 2 ;;
+    esac
+done
+
+BINDIR=$(pg_config --bindir)
+PGDATA=$(mktemp -d)
+PORT=${PORT:-54329}
+
+cleanup() {
+    "$BINDIR/pg_ctl" -D "$PGDATA" -m immediate stop >/dev/null 2>&1 || true
+    rm -rf "$PGDATA"
+}
+trap cleanup EXIT
+
+"$BINDIR/initdb" -D "$PGDATA" -U postgres -A trust --no-sync >/dev/null
+"$BINDIR/pg_ctl" -D "$PGDATA" -l "$PGDATA/server.log" -w \
+    -o "-k $PGDATA -p $PORT -c listen_addresses='' -c fsync=off -c max_parallel_workers_per_gather=0 -c work_mem=256MB" \
+    start >/dev/null
+
+sql() {
+    "$BINDIR/psql" -X -q -v ON_ERROR_STOP=1 -h "$PGDATA" -p "$PORT" -U postgres -d postgres "$@"
+}
+
+sql <<SQL
+CREATE EXTENSION pg_cost_basis;
+\i $DIR/generate.sql
+\i $DIR/reference.sql
+CREATE TABLE cb_bench_results (rows bigint, method text, impl text, seconds float, rows_per_second float, peak_kb bigint);
+CREATE TABLE cb_bench_mismatches (rows bigint, method text, mismatches bigint);
+SQL
+
+declare -A EXT_QUERIES=(
+    [acb0]="SELECT tag, cb_acb0_capital_gain(s) capital_gain, cb_acb0_balance_after(s) balance_after, cb_acb0_cost_basis_after(s) cost_basis_after
+            FROM (SELECT tag, cb_acb0(price, CASE WHEN dest_account IS NULL THEN amount ELSE 0.0 END) OVER (ORDER BY tag) s FROM cb_bench_trades) t"
+    [acb]="SELECT tag, cb_acb_capital_gain(s) capital_gain, cb_acb_balance_after(s) balance_after, cb_acb_cost_basis_after(s) cost_basis_after
+           FROM (SELECT tag, cb_acb(account, dest_account, price, amount, tag, NULL::bool, transfer_id) OVER (ORDER BY tag) s FROM cb_bench_trades) t"
+    [fifo]="SELECT tag, cb_fifo_capital_gain(s) capital_gain
+            FROM (SELECT tag, cb_fifo(account, dest_account, price, amount, tag, NULL::bool, transfer_id) OVER (ORDER BY tag) s FROM cb_bench_trades) t"
+)
+
+declare -A COMPARED_COLUMNS=(
+    [acb0]="capital_gain balance_after cost_basis_after"
+    [acb]="capital_gain balance_after cost_basis_after"
+    [fifo]="capital_gain"
+)
+
+# run_case rows method impl query: time the query in a new backend, its output goes to cb_bench_out_<impl>_<method>
+run_case() {
+    local rows=$1 method=$2 impl=$3 query=$4
+    sql <<SQL
+DROP TABLE IF EXISTS cb_bench_out_${impl}_${method};
+SELECT clock_timestamp() AS started \gset
+CREATE UNLOGGED TABLE cb_bench_out_${impl}_${method} AS $query;
+INSERT INTO cb_bench_results
+SELECT $rows, '$method', '$impl', seconds, $rows / seconds, peak_kb
+FROM (SELECT extract(epoch FROM clock_timestamp() - :'started'::timestamptz)::float seconds,
+             substring(pg_read_file('/proc/self/status') FROM 'VmHWM:\s*(\d+) kB')::bigint peak_kb) m;
+SQL
+}
+
+# compare rows method: count rows of the aggregate that differ from the reference
+compare() {
+    local rows=$1 method=$2 condition="r.tag IS NULL OR e.tag IS NULL"
+    for column in ${COMPARED_COLUMNS[$method]}; do
+        condition="$condition OR abs(e.$column - r.$column) > 1e-6 * (1.0 + abs(r.$column))"
+    done
+    sql <<SQL
+INSERT INTO cb_bench_mismatches
+SELECT $rows, '$method', count(*)
+FROM cb_bench_out_ext_${method} e FULL JOIN cb_bench_out_ref_${method} r USING (tag)
+WHERE $condition;
+SQL
+}
+
+for rows in $ROWS; do
+    echo "generating $rows rows"
+    sql -c "SELECT cb_bench_generate($rows, $ACCOUNTS, 0.42)" >/dev/null
+    for method in acb0 acb fifo; do
+        echo "  $method"
+        run_case "$rows" "$method" ext "${EXT_QUERIES[$method]}"
+        run_case "$rows" "$method" ref "SELECT * FROM cb_ref_${method}()"
+        compare "$rows" "$method"
+    done
+done
+
+if [ -n "$BASELINE" ]; then
+    sql <<SQL
+CREATE TABLE cb_bench_baseline (LIKE cb_bench_results);
+\copy cb_bench_baseline FROM '$BASELINE' CSV HEADER
+SQL
+else
+    sql -c "CREATE TABLE cb_bench_baseline (LIKE cb_bench_results)"
+fi
+
+sql -c "\copy (SELECT * FROM cb_bench_results ORDER BY rows, method, impl) TO '$OUTPUT' CSV HEADER"
+
+sql <<SQL
+SELECT e.rows, e.method,
+       round(e.rows_per_second) ext_rows_per_second, round(r.rows_per_second) ref_rows_per_second,
+       round((e.rows_per_second / r.rows_per_second)::numeric, 1) speedup,
+       e.peak_kb ext_peak_kb, r.peak_kb ref_peak_kb,
+       round(b.rows_per_second) baseline_rows_per_second,
+       m.mismatches
+FROM cb_bench_results e
+JOIN cb_bench_results r ON r.rows = e.rows AND r.method = e.method AND r.impl = 'ref'
+JOIN cb_bench_mismatches m ON m.rows = e.rows AND m.method = e.method
+LEFT JOIN cb_bench_baseline b ON b.rows = e.rows AND b.method = e.method AND b.impl = 'ext'
+WHERE e.impl = 'ext'
+ORDER BY e.rows, e.method;
+SQL
+
+FAILURES=$(sql -At <<SQL
+SELECT format('%s rows, %s: %s rows differ from the reference', rows, method, mismatches)
+FROM cb_bench_mismatches WHERE mismatches > 0
+UNION ALL
+SELECT format('%s rows, %s: slower than the reference', e.rows, e.method)
+FROM cb_bench_results e JOIN cb_bench_results r ON r.rows = e.rows AND r.method = e.method AND r.impl = 'ref'
+WHERE e.impl = 'ext' AND e.rows_per_second < r.rows_per_second
+UNION ALL
+SELECT format('%s rows, %s: %s rows/s, baseline %s rows/s', e.rows, e.method, round(e.rows_per_second), round(b.rows_per_second))
+FROM cb_bench_results e JOIN cb_bench_baseline b ON b.rows = e.rows AND b.method = e.method AND b.impl = 'ext'
+WHERE e.impl = 'ext' AND e.rows_per_second < b.rows_per_second * (1.0 - $MAX_REGRESSION);
+SQL
+)
+
+if [ -n "$FAILURES" ]; then
+    echo "FAILED"
+    echo "$FAILURES"
+    exit 1
+fi
+echo "results in $OUTPUT"
@@ -1,23 +1,15 @@
-#include "common.h"
+#include "core/acb0.h"
 
-#include <cmath>
+// IMPORTANT: If this fails, change the expected size and adjust(!!!) pg_cost_basis--1.0.sql
+static_assert(sizeof(CbAcb0State) == 40);
 
 extern "C"
 {
 #include <postgres.h>
 #include <fmgr.h>
-
-struct CbAcb0State
-{
-    double mCostBasisBefore;
-    double mCostBasisAfter;
-    double mBalanceBefore;
-    double mBalanceAfter;
-    double mCapitalGain;
-};
-
-// IMPORTANT: If this fails, change the expected size and adjust(!!!) pg_cost_basis--1.0.sql
-static_assert(sizeof(CbAcb0State) == 40);
+#include <catalog/pg_type_d.h>
+#include <funcapi.h>
+#include <utils/array.h>
 
 PG_FUNCTION_INFO_V1(CbAcb0State_in);
 Datum CbAcb0State_in(PG_FUNCTION_ARGS)
@@ -93,7 +85,8 @@ Datum CbAcb0_sfunc(PG_FUNCTION_ARGS)
                 (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                  errmsg("acb state can't be null")));
     }
-    CbAcb0State* state = reinterpret_cast<CbAcb0State*>(PG_GETARG_POINTER(0));
+    // Copy the previous state, the new one may be written over it
+    const CbAcb0State prev = *reinterpret_cast<CbAcb0State*>(PG_GETARG_POINTER(0));
 
     if (PG_ARGISNULL(2)) [[unlikely]]
     {
@@ -103,21 +96,8 @@ Datum CbAcb0_sfunc(PG_FUNCTION_ARGS)
     }
     double amount = PG_GETARG_FLOAT8(2);
 
-    void* buffer = palloc(sizeof(CbAcb0State));
-    CbAcb0State* newState;
-
-    // CbAcb0State (cost_basis_before, cost_basis_after, balance_before, balance_after, capital_gains)
-    // std::signbit - returns false for positives, true for negatives
-
-    if (amount == 0) [[unlikely]]
-    {
-        newState = new (buffer) CbAcb0State{
-                state->mCostBasisAfter, state->mCostBasisAfter,
-                state->mBalanceAfter, state->mBalanceAfter,
-                0.0
-        };
-    }
-    else
+    double price = 0.0;
+    if (amount != 0) [[likely]]
     {
         if (PG_ARGISNULL(1)) [[unlikely]]
         {
@@ -125,48 +105,146 @@ Datum CbAcb0_sfunc(PG_FUNCTION_ARGS)
                     (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                      errmsg("price can't be null")));
         }
-        double price = PG_GETARG_FLOAT8(1);
-
-        double balanceAfter = state->mBalanceAfter + amount;
-        if (std::abs(balanceAfter) < AMOUNT_EPSILON)
-            balanceAfter = 0.0;
-
-        // -- open position, increase position
-        if (std::signbit(state->mBalanceAfter) == std::signbit(amount))
-        {            
-            double costBasisAfter = balanceAfter == 0.0 ?
-                        state->mCostBasisAfter :
-                        (state->mCostBasisAfter * state->mBalanceAfter + price * amount) / balanceAfter;
-
-            newState = new (buffer) CbAcb0State{
-                    state->mCostBasisAfter, costBasisAfter,
-                    state->mBalanceAfter, balanceAfter,
-                    0.0
-            };
+        price = PG_GETARG_FLOAT8(1);
+    }
+
+    // Inside an aggregate the transition value lives in the aggregate context, update it in place
+    // instead of allocating a new state for every row
+    void* buffer = AggCheckCallContext(fcinfo, nullptr) ?
+        PG_GETARG_POINTER(0) :
+        palloc(sizeof(CbAcb0State));
+    CbAcb0State* newState = new (buffer) CbAcb0State(acb0Step(prev.mCostBasisAfter, prev.mBalanceAfter, price, amount));
+
+    PG_RETURN_POINTER(newState);
+}
+
+// One-dimensional float8 array argument, elements are read in place when there are no nulls
+static ArrayType* float8ArrayArg(FunctionCallInfo fcinfo, int argno, const char* name, int* numItems)
+{
+    ArrayType* array = PG_GETARG_ARRAYTYPE_P(argno);
+    if (ARR_NDIM(array) > 1) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("%s must be a one-dimensional array", name)));
+    }
+
+    *numItems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+    return array;
+}
+
+// Prices may be null where the amount is 0, like the price argument of cb_acb0. Such arrays are expanded
+// into a dense copy with zeros in place of nulls, so the kernel always reads a plain array.
+static const double* densePrices(ArrayType* prices, const double* amounts, int numItems)
+{
+    if (!ARR_HASNULL(prices)) [[likely]]
+        return reinterpret_cast<const double*>(ARR_DATA_PTR(prices));
+
+    const bits8* nullBitmap = ARR_NULLBITMAP(prices);
+    const double* values = reinterpret_cast<const double*>(ARR_DATA_PTR(prices));
+    double* dense = static_cast<double*>(palloc(static_cast<Size>(numItems) * sizeof(double)));
+
+    for (int i = 0; i < numItems; ++i)
+    {
+        if (nullBitmap[i / 8] & (1 << (i % 8)))
+        {
+            dense[i] = *values++;
         }
-        // close position and do NOT cross 0 volume
-        // cost basis doesn't change as a result
-        else if (std::signbit(state->mBalanceAfter) == std::signbit(balanceAfter))
+        else if (amounts[i] != 0)
         {
-            newState = new (buffer) CbAcb0State{
-                    state->mCostBasisAfter, state->mCostBasisAfter,
-                    state->mBalanceAfter, balanceAfter,
-                    amount * (state->mCostBasisAfter - price)
-            };
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("price %d can't be null", i + 1)));
         }
-        // close position and cross 0
-        // cost basis becomes equal to price
         else
         {
-            newState = new (buffer) CbAcb0State{
-                    state->mCostBasisAfter, price,
-                    state->mBalanceAfter, balanceAfter,
-                    state->mBalanceAfter * (price - state->mCostBasisAfter)
-            };
+            dense[i] = 0.0;
         }
     }
+    return dense;
+}
 
-    PG_RETURN_POINTER(newState);
+// Uninitialized one-dimensional float8 array, the kernel writes results straight into its data
+static ArrayType* newFloat8Array(int numItems)
+{
+    if (numItems == 0)
+        return construct_empty_array(FLOAT8OID);
+
+    Size size = ARR_OVERHEAD_NONULLS(1) + static_cast<Size>(numItems) * sizeof(double);
+    ArrayType* array = static_cast<ArrayType*>(palloc(size));
+    SET_VARSIZE(array, size);
+    array->ndim = 1;
+    array->dataoffset = 0;
+    array->elemtype = FLOAT8OID;
+    ARR_DIMS(array)[0] = numItems;
+    ARR_LBOUND(array)[0] = 1;
+    return array;
+}
+
+// cb_acb0 over whole arrays of prices and amounts in one call: no function call and no state allocation per row.
+// The loop carries only cost basis and balance and writes every output into its own contiguous array.
+PG_FUNCTION_INFO_V1(CbAcb0_batch);
+Datum CbAcb0_batch(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupleDesc;
+    if (get_call_result_type(fcinfo, nullptr, &tupleDesc) != TYPEFUNC_COMPOSITE) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("function returning record called in context that cannot accept type record")));
+    }
+
+    int numPrices;
+    int numAmounts;
+    ArrayType* pricesArray = float8ArrayArg(fcinfo, 0, "prices", &numPrices);
+    ArrayType* amountsArray = float8ArrayArg(fcinfo, 1, "amounts", &numAmounts);
+    if (numPrices != numAmounts) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                 errmsg("prices and amounts must have the same length, got %d and %d", numPrices, numAmounts)));
+    }
+
+    if (ARR_HASNULL(amountsArray)) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("amounts can't contain nulls")));
+    }
+    const double* amounts = reinterpret_cast<const double*>(ARR_DATA_PTR(amountsArray));
+    const double* prices = densePrices(pricesArray, amounts, numAmounts);
+
+    ArrayType* results[5];
+    for (ArrayType*& result : results)
+        result = newFloat8Array(numAmounts);
+
+    double* __restrict costBasisBefore = reinterpret_cast<double*>(ARR_DATA_PTR(results[0]));
+    double* __restrict costBasisAfter = reinterpret_cast<double*>(ARR_DATA_PTR(results[1]));
+    double* __restrict balanceBefore = reinterpret_cast<double*>(ARR_DATA_PTR(results[2]));
+    double* __restrict balanceAfter = reinterpret_cast<double*>(ARR_DATA_PTR(results[3]));
+    double* __restrict capitalGain = reinterpret_cast<double*>(ARR_DATA_PTR(results[4]));
+
+    double costBasis = ACB0_INITIAL_COST_BASIS;
+    double balance = ACB0_INITIAL_BALANCE;
+    for (int i = 0; i < numAmounts; ++i)
+    {
+        const CbAcb0State state = acb0Step(costBasis, balance, prices[i], amounts[i]);
+
+        costBasisBefore[i] = state.mCostBasisBefore;
+        costBasisAfter[i] = state.mCostBasisAfter;
+        balanceBefore[i] = state.mBalanceBefore;
+        balanceAfter[i] = state.mBalanceAfter;
+        capitalGain[i] = state.mCapitalGain;
+
+        costBasis = state.mCostBasisAfter;
+        balance = state.mBalanceAfter;
+    }
+
+    Datum values[5];
+    bool nulls[5] = {false, false, false, false, false};
+    for (int i = 0; i < 5; ++i)
+        values[i] = PointerGetDatum(results[i]);
+    return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupleDesc), values, nulls));
 }
 
 } // extern "C"
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "common.h"
+#include "accounts.h"
+#include "errors.h"
+#include "transfers.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "core/acb_book.h"
+
+#include <cmath>
+#include <algorithm>
+
+extern "C"
+{
+#include <catalog/pg_type_d.h>
+#include <funcapi.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+}
+
+// Size of an entry in snapshots
+inline constexpr size_t SNAPSHOT_ENTRY_SIZE = 2 * sizeof(double);
+
+inline void writeEntry(StringInfo buf, const CbAcbAccountEntry& entry)
+{
+    pq_sendfloat8(buf, entry.mCostBasis);
+    pq_sendfloat8(buf, entry.mAmount);
+}
+
+[[nodiscard]] inline CbAcbAccountEntry readEntry(StringInfo buf)
+{
+    CbAcbAccountEntry entry;
+    entry.mCostBasis = pq_getmsgfloat8(buf);
+    entry.mAmount = pq_getmsgfloat8(buf);
+    return entry;
+}
+
+// State of the average cost basis aggregates. Entries are updated by CbAcbBook of the core engines, the outputs
+// of the row are the fields of CbAcbRow. The state adds memory contexts, the account dictionary and snapshots.
+class CbAcbState : public CbAcbRow
+{
+    using Book = CbAcbBook<PgContextAllocator<char>, CbPgErrors>;
+
+    struct SharedState
+    {
+        SharedState(MemoryContext memoryContext, CbAccountDictionary* sharedAccounts)
+            : mMemoryContext(memoryContext)
+            , mAccounts(sharedAccounts != nullptr ? sharedAccounts : &mOwnAccounts)
+            , mBook(PgContextAllocator<char>(memoryContext), CbPgErrors{mAccounts})
+        {}
+
+        // Owns all the memory of the shared state
+        MemoryContext mMemoryContext;
+        // Empty when the dictionary is shared
+        CbAccountDictionary mOwnAccounts;
+        // mOwnAccounts or the dictionary of cb_multi, see beginRow
+        CbAccountDictionary* mAccounts;
+        // (cost basis, amount) of every account and pending transfers
+        Book mBook;
+        // Sum of capital gains of all rows since the shared state was created, not a part of snapshots
+        double mTotalGain = 0.0;
+        // Runtime statistics since the shared state was created, not a part of snapshots, see statsToRecord
+        uint64_t mRows = 0;
+        size_t mPeakPendingTransfers = 0;
+        // Validation when the aggregate is done, see CbAggregateEnd
+        typename CbAggregateEnd<SharedState>::Link mAggregateEnd;
+
+        // Accounts, (cost basis, amount) of every account, pending transfers
+        void writeBook(StringInfo buf) const
+        {
+            mAccounts->write(buf);
+
+            pq_sendint32(buf, static_cast<uint32_t>(mBook.numAccounts()));
+            for (AccountId account = 0; account < mBook.numAccounts(); ++account)
+                writeEntry(buf, mBook.accountEntry(account));
+
+            writeTransfers(buf, mBook.transfers(), writeEntry);
+        }
+
+        void readBook(StringInfo buf)
+        {
+            // Containers allocate from the current memory context
+            MemoryContext oldContext = MemoryContextSwitchTo(mMemoryContext);
+
+            mAccounts->read(buf);
+
+            uint32_t numAccounts = readCount(buf, SNAPSHOT_ENTRY_SIZE);
+            for (AccountId account = 0; account < numAccounts; ++account)
+                mBook.accountEntry(account) = readEntry(buf);
+
+            readTransfers(buf, mBook.transfers(), readEntry);
+
+            // Account ids of a snapshot are used as indexes, make sure a corrupted one can't point outside
+            mBook.transfers().forEach([this](const auto& transfer) {
+                if (transfer.mSourceAccount >= mAccounts->size() || transfer.mDestinationAccount >= mAccounts->size()) [[unlikely]]
+                {
+                    ereport(ERROR,
+                            (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                             errmsg("invalid cost basis snapshot: unknown account id in transfer")));
+                }
+            });
+
+            MemoryContextSwitchTo(oldContext);
+        }
+
+        // Unfinished transfers are warnings, remaining amounts are for information
+        void validateAtEnd() const
+        {
+            const CbAccountDictionary& accounts = *mAccounts;
+
+            mBook.transfers().forEach([&accounts](const auto& transfer) {
+                ereport(WARNING,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("unfinished transfer detected %s -> %s: %g, withdrawal without deposit",
+                                accounts.name(transfer.mSourceAccount), accounts.name(transfer.mDestinationAccount), transfer.mAmount)));
+            });
+
+            for (AccountId account = 0; account < mBook.numAccounts(); ++account)
+            {
+                const CbAcbAccountEntry& accountEntry = mBook.accountEntry(account);
+                if (std::abs(accountEntry.mAmount) >= AMOUNT_EPSILON)
+                {
+                    ereport(INFO,
+                            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                             errmsg("remaining amount detected %s %g, not all amount was realized at end",
+                                    accounts.name(account), accountEntry.mAmount)));
+                }
+            }
+        }
+    };
+
+    // Allocated lazily, shared between calls, see newSharedState for its lifetime
+    // Contains (cost basis, amount) for each account and pending asset transfers
+    SharedState* mSharedState = nullptr;
+
+ public:
+    [[nodiscard]] static CbAcbState* newState()
+    {
+        return new (palloc(sizeof(CbAcbState))) CbAcbState{};
+    }
+
+    void writeSnapshot(StringInfo buf) const
+    {
+        writeSnapshotHeader(buf, CbMethod::Acb);
+
+        pq_sendbyte(buf, mSharedState != nullptr);
+        if (mSharedState != nullptr)
+            mSharedState->writeBook(buf);
+
+        pq_sendfloat8(buf, mCostBasisBefore);
+        pq_sendfloat8(buf, mCostBasisAfter);
+        pq_sendfloat8(buf, mBalanceBefore);
+        pq_sendfloat8(buf, mBalanceAfter);
+        pq_sendfloat8(buf, mCapitalGain);
+    }
+
+    [[nodiscard]] MemoryContext memoryContext() const noexcept
+    {
+        return mSharedState->mMemoryContext;
+    }
+
+    [[nodiscard]] bool hasSharedState() const noexcept
+    {
+        return mSharedState != nullptr;
+    }
+
+    [[nodiscard]] CbAccountDictionary& accounts() noexcept
+    {
+        return *mSharedState->mAccounts;
+    }
+
+    // Prepare the state to process the next row in place, outputs of previous rows are stored in emitted states.
+    // A new shared state is validated when aggContext is reset, callers that validate it themselves pass null.
+    // cb_multi passes its dictionary in sharedAccounts, the engine names its accounts by it instead of a dictionary
+    // of its own.
+    void beginRow(MemoryContext sharedParent, MemoryContext aggContext, bool resetSharedState, [[maybe_unused]] bool keepRealized, const bytea* snapshot,
+                  CbAccountDictionary* sharedAccounts = nullptr)
+    {
+        if (mSharedState != nullptr && resetSharedState)
+            validateAtEnd();
+
+        // The previous shared state may still be referenced by emitted states, it is released with its parent
+        if (mSharedState == nullptr || resetSharedState)
+        {
+            mSharedState = newSharedState<SharedState>(sharedParent, sharedAccounts);
+            if (aggContext != nullptr)
+                CbAggregateEnd<SharedState>::registerFor(aggContext, mSharedState);
+
+            // Only the book of the snapshot is restored, the row part belongs to the row that was snapshotted
+            if (snapshot != nullptr)
+            {
+                StringInfoData buf = snapshotReader(snapshot);
+                readSnapshotHeader(&buf, CbMethod::Acb);
+                if (pq_getmsgbyte(&buf) != 0)
+                    mSharedState->readBook(&buf);
+            }
+        }
+
+        row() = CbAcbRow{};
+    }
+
+    // All outputs are stored in the state itself, only the total gain and statistics are accumulated
+    void endRow() noexcept
+    {
+        mSharedState->mTotalGain += mCapitalGain;
+
+        ++mSharedState->mRows;
+        mSharedState->mPeakPendingTransfers = std::max(mSharedState->mPeakPendingTransfers, mSharedState->mBook.transfers().size());
+    }
+
+    // Sum of capital gains of all processed rows, the result of total gain aggregates
+    [[nodiscard]] double totalGain() const noexcept
+    {
+        return mSharedState != nullptr ? mSharedState->mTotalGain : 0.0;
+    }
+
+    // Record of parallel arrays (accounts, amounts, cost_bases) of accounts with a non-zero balance,
+    // the result of holdings aggregates. Accounts are listed in the order of first appearance.
+    [[nodiscard]] Datum holdingsToArrays(FunctionCallInfo fcinfo) const
+    {
+        CbPhaseTimer timer(CbPhase::Accessors);
+
+        TupleDesc tupleDesc;
+        if (get_call_result_type(fcinfo, nullptr, &tupleDesc) != TYPEFUNC_COMPOSITE) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("function returning record called in context that cannot accept type record")));
+        }
+
+        size_t numAccounts = mSharedState != nullptr ? mSharedState->mBook.numAccounts() : 0;
+        Datum* elems = static_cast<Datum*>(palloc(std::max<size_t>(numAccounts, 1) * 3 * sizeof(Datum)));
+        Datum* accounts = elems;
+        Datum* amounts = elems + numAccounts;
+        Datum* costBases = elems + 2 * numAccounts;
+
+        size_t n = 0;
+        for (AccountId account = 0; account < numAccounts; ++account)
+        {
+            const CbAcbAccountEntry& entry = mSharedState->mBook.accountEntry(account);
+            if (std::abs(entry.mAmount) < AMOUNT_EPSILON)
+                continue;
+
+            accounts[n] = CStringGetTextDatum(mSharedState->mAccounts->name(account));
+            amounts[n] = Float8GetDatum(entry.mAmount);
+            costBases[n] = Float8GetDatum(entry.mCostBasis);
+            ++n;
+        }
+
+        Datum values[3] = {
+            PointerGetDatum(n != 0 ? construct_array_builtin(accounts, static_cast<int>(n), TEXTOID) : construct_empty_array(TEXTOID)),
+            PointerGetDatum(n != 0 ? construct_array_builtin(amounts, static_cast<int>(n), FLOAT8OID) : construct_empty_array(FLOAT8OID)),
+            PointerGetDatum(n != 0 ? construct_array_builtin(costBases, static_cast<int>(n), FLOAT8OID) : construct_empty_array(FLOAT8OID)),
+        };
+        bool nulls[3] = {false, false, false};
+        return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupleDesc), values, nulls));
+    }
+
+    // Record (rows, accounts, pending_transfers, peak_pending_transfers, accounts_load_factor, memory_bytes)
+    // of the shared state, see CbLotState::statsToRecord
+    [[nodiscard]] Datum statsToRecord(FunctionCallInfo fcinfo) const
+    {
+        CbPhaseTimer timer(CbPhase::Accessors);
+
+        TupleDesc tupleDesc;
+        if (get_call_result_type(fcinfo, nullptr, &tupleDesc) != TYPEFUNC_COMPOSITE) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("function returning record called in context that cannot accept type record")));
+        }
+
+        Datum values[6] = {Int64GetDatum(0), Int64GetDatum(0), Int64GetDatum(0), Int64GetDatum(0), Float8GetDatum(0.0), Int64GetDatum(0)};
+        if (mSharedState != nullptr)
+        {
+            values[0] = Int64GetDatum(static_cast<int64_t>(mSharedState->mRows));
+            values[1] = Int64GetDatum(static_cast<int64_t>(mSharedState->mAccounts->size()));
+            values[2] = Int64GetDatum(static_cast<int64_t>(mSharedState->mBook.transfers().size()));
+            values[3] = Int64GetDatum(static_cast<int64_t>(mSharedState->mPeakPendingTransfers));
+            values[4] = Float8GetDatum(mSharedState->mAccounts->loadFactor());
+            values[5] = Int64GetDatum(static_cast<int64_t>(MemoryContextMemAllocated(mSharedState->mMemoryContext, true)));
+        }
+        bool nulls[6] = {false, false, false, false, false, false};
+        return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupleDesc), values, nulls));
+    }
+
+    void realize(AccountId account, double price, double amount, [[maybe_unused]] int64_t tag)
+    {
+        mSharedState->mBook.realize(account, price, amount, row());
+    }
+
+    void initiateTransfer(
+            AccountId account, AccountId destinationAccount, std::optional<std::string_view> txId,
+            double amount, std::optional<double> price,
+            int64_t tag)
+    {
+        mSharedState->mBook.initiateTransfer(account, destinationAccount, txId, amount, price, tag, row());
+    }
+
+    void finalizeTransfer(AccountId account, AccountId sourceAccount, std::optional<std::string_view> transferId, double amount, int64_t tag)
+    {
+        mSharedState->mBook.finalizeTransfer(account, sourceAccount, transferId, amount, tag, row());
+    }
+
+    // Reports unfinished transfers and remaining amounts, the aggregate end callback doesn't repeat it
+    void validateAtEnd() const
+    {
+        CbAggregateEnd<SharedState>::unregister(mSharedState);
+        mSharedState->validateAtEnd();
+    }
+
+private:
+    [[nodiscard]] CbAcbRow& row() noexcept
+    {
+        return *this;
+    }
+};
+
+// IMPORTANT: If this fails, change the expected size and adjust(!!!) pg_cost_basis--1.0.sql
+static_assert(sizeof(CbAcbState) == 48);
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "common.h"
+#include "flat_hash_set.h"
+#include "snapshot.h"
+
+#include <string_view>
+
+// Maps accounts to dense ids. Lots and transfers carry 4-byte ids instead of account names.
+// Accounts are either names (text) or integer surrogate keys (int4, int8), one aggregate uses only one kind.
+// Ids are indexes in the flat hash set of the used kind, looking up a known account doesn't allocate.
+//
+// Portfolio aggregates key lots by (asset, account) positions. Assets and accounts are interned as keys of the same kind,
+// pairs of their ids are interned once more into dense position ids. Engines see positions as accounts.
+class CbAccountDictionary
+{
+public:
+    static constexpr AccountId npos = PgFlatHashSet<int64_t>::npos;
+
+    [[nodiscard]] AccountId intern(std::string_view name)
+    {
+        return mByName.insert(name);
+    }
+
+    [[nodiscard]] AccountId intern(int64_t key)
+    {
+        return mByKey.insert(key);
+    }
+
+    [[nodiscard]] AccountId internPosition(AccountId asset, AccountId account)
+    {
+        return mPositions.insert(positionKey(asset, account));
+    }
+
+    // Look up without interning, returns npos for unknown accounts.
+    // Ids of portfolio aggregates are positions, plain account lookups always fail for them.
+    [[nodiscard]] AccountId find(std::string_view name) const
+    {
+        return isPortfolio() ? npos : mByName.find(name);
+    }
+
+    [[nodiscard]] AccountId find(int64_t key) const
+    {
+        return isPortfolio() ? npos : mByKey.find(key);
+    }
+
+    template<typename Key>
+    [[nodiscard]] AccountId findPosition(const Key& asset, const Key& account) const
+    {
+        AccountId assetId = findKey(asset);
+        AccountId accountId = findKey(account);
+        if (assetId == npos || accountId == npos)
+            return npos;
+        return mPositions.find(positionKey(assetId, accountId));
+    }
+
+    // Account name for messages, "asset/account" for positions
+    [[nodiscard]] const char* name(AccountId id) const
+    {
+        if (!isPortfolio())
+            return keyName(id);
+
+        uint64_t key = static_cast<uint64_t>(mPositions.key(id));
+        return psprintf("%s/%s", keyName(static_cast<AccountId>(key >> 32)), keyName(static_cast<AccountId>(key)));
+    }
+
+    // Keys are written in insertion order, interning them again in the same order restores the same ids
+    void write(StringInfo buf) const
+    {
+        pq_sendint32(buf, static_cast<uint32_t>(mByName.size()));
+        for (AccountId id = 0; id < mByName.size(); ++id)
+            writeString(buf, mByName.key(id));
+
+        pq_sendint32(buf, static_cast<uint32_t>(mByKey.size()));
+        for (AccountId id = 0; id < mByKey.size(); ++id)
+            pq_sendint64(buf, mByKey.key(id));
+
+        pq_sendint32(buf, static_cast<uint32_t>(mPositions.size()));
+        for (AccountId id = 0; id < mPositions.size(); ++id)
+            pq_sendint64(buf, mPositions.key(id));
+    }
+
+    void read(StringInfo buf)
+    {
+        for (uint32_t n = readCount(buf, sizeof(uint32_t)); n > 0; --n)
+            (void)intern(readString(buf));
+
+        for (uint32_t n = readCount(buf, sizeof(int64_t)); n > 0; --n)
+            (void)intern(static_cast<int64_t>(pq_getmsgint64(buf)));
+
+        for (uint32_t n = readCount(buf, sizeof(int64_t)); n > 0; --n)
+            (void)mPositions.insert(static_cast<int64_t>(pq_getmsgint64(buf)));
+    }
+
+    // Number of accounts, or of positions for portfolio aggregates
+    [[nodiscard]] size_t size() const noexcept
+    {
+        return isPortfolio() ? mPositions.size() : mByName.size() + mByKey.size();
+    }
+
+    // Keys over slots of the hash sets, kept below 3/4 by the sets
+    [[nodiscard]] double loadFactor() const noexcept
+    {
+        size_t capacity = mByName.capacity() + mByKey.capacity() + mPositions.capacity();
+        if (capacity == 0)
+            return 0.0;
+        return static_cast<double>(mByName.size() + mByKey.size() + mPositions.size()) / static_cast<double>(capacity);
+    }
+
+private:
+    PgFlatHashSet<PgString> mByName;
+    PgFlatHashSet<int64_t> mByKey;
+    PgFlatHashSet<int64_t> mPositions;
+
+    [[nodiscard]] bool isPortfolio() const noexcept
+    {
+        return mPositions.size() != 0;
+    }
+
+    [[nodiscard]] static int64_t positionKey(AccountId asset, AccountId account) noexcept
+    {
+        return static_cast<int64_t>((static_cast<uint64_t>(asset) << 32) | account);
+    }
+
+    [[nodiscard]] AccountId findKey(std::string_view name) const
+    {
+        return mByName.find(name);
+    }
+
+    [[nodiscard]] AccountId findKey(int64_t key) const
+    {
+        return mByKey.find(key);
+    }
+
+    [[nodiscard]] const char* keyName(AccountId id) const
+    {
+        if (mByKey.size() == 0)
+            return mByName.key(id).c_str();
+
+        // Integer keys are formatted only when a message needs them
+        return psprintf("%ld", mByKey.key(id));
+    }
+};
@@ -1,11 +1,15 @@
 #pragma once
 
 #include "pg_allocator.h"
+#include "core/core.h"
 
+#include <cmath>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 #include <unordered_map>
+#include <utility>
 
 extern "C" {
 #include <varatt.h>
@@ -22,45 +26,95 @@ using PgVector = std::vector<T, PgAllocator<T>>;
 template<typename Key, typename T, typename Hash = std::hash<Key>, typename Comp = std::equal_to<Key>>
 using PgUnorderedMap = std::unordered_map<Key, T, Hash, Comp, PgAllocator<std::pair<const Key, T>>>;
 
-// Treat all amounts below AMOUNT_EPSILON as zeros
-static constexpr const double AMOUNT_EPSILON = 1e-11;
+// Transparent hash, PgString keys can be looked up by std::string_view without materializing a PgString
+template<>
+struct std::hash<PgString> : private std::hash<std::string_view>
+{
+    using is_transparent = void;
 
-// Verify that incoming transfer amount is equal to outgoing transfer amount with the following abs precision
-static constexpr const double TRANSFER_AMOUNT_EPSILON = 1e-8;
+    [[nodiscard]] std::size_t operator()(std::string_view s) const noexcept
+    {
+        return std::hash<std::string_view>::operator()(s);
+    }
+};
 
-template<typename AccountEntry>
-struct CbTransfer
+// State shared between rows lives in its own memory context, a child of parentContext.
+// Emitted states point to it and may outlive the aggregate context, which postgres resets at the end of every
+// window partition and before every group, e.g. while window output is sorted by an outer ORDER BY. Aggregates that
+// emit their state pass the per-query context, their shared states are released together with the query.
+// Where no state can escape, the parent is the aggregate (or run) context and the shared state goes with it.
+// Contexts start small so that queries with many small groups don't hold a default sized block per group.
+// The shared state is constructed from its memory context and args.
+template<typename SharedState, typename... Args>
+[[nodiscard]] SharedState* newSharedState(MemoryContext parentContext, Args&&... args)
 {
+    MemoryContext context = AllocSetContextCreate(parentContext, "pg_cost_basis shared state", ALLOCSET_START_SMALL_SIZES);
+    MemoryContext oldContext = MemoryContextSwitchTo(context);
+    SharedState* sharedState = new (pallocHook<SharedState>()) SharedState{context, std::forward<Args>(args)...};
+    MemoryContextSwitchTo(oldContext);
+    return sharedState;
+}
 
-    // Some transfers can provide unique transfer id, in this case it's a preferred way to match outgoing and incoming records
-    std::optional<PgString> mTransferId;
-
-    // For the rest, we rely on triplet (source, dest, amount)
-    PgString mSourceAccount;
-    PgString mDestinationAccount;
-    double mAmount;
+// Calls validateAtEnd() of a shared state when its aggregate (window partition or group) is done, that is when
+// postgres resets the aggregate context. The shared state normally outlives the aggregate context, but on error
+// both are deleted in any order, so whichever goes first unlinks the other.
+template<typename SharedState>
+class CbAggregateEnd
+{
+public:
+    // Member of the shared state, its callback runs when the memory context of the shared state is deleted
+    struct Link
+    {
+        CbAggregateEnd* mEnd = nullptr;
+        MemoryContextCallback mCallback{};
+    };
 
-    PgVector<AccountEntry> mEntries;
+    static void registerFor(MemoryContext aggContext, SharedState* sharedState)
+    {
+        CbAggregateEnd* end = new (pallocHook<CbAggregateEnd>(1, aggContext)) CbAggregateEnd{};
+        end->mSharedState = sharedState;
+        end->mCallback.func = onAggregateEnd;
+        end->mCallback.arg = end;
+        MemoryContextRegisterResetCallback(aggContext, &end->mCallback);
+
+        Link& link = sharedState->mAggregateEnd;
+        link.mEnd = end;
+        link.mCallback.func = onSharedStateRelease;
+        link.mCallback.arg = &link;
+        MemoryContextRegisterResetCallback(sharedState->mMemoryContext, &link.mCallback);
+    }
 
-    bool operator==(const CbTransfer& o) const
+    // The shared state was checked before the aggregate is done, e.g. by a final function
+    static void unregister(SharedState* sharedState) noexcept
     {
-        if (mTransferId.has_value() && o.mTransferId.has_value())
-            return mTransferId == o.mTransferId;
+        Link& link = sharedState->mAggregateEnd;
+        if (link.mEnd != nullptr)
+        {
+            link.mEnd->mSharedState = nullptr;
+            link.mEnd = nullptr;
+        }
+    }
 
-        // if mTransferId is defined for either in or out record then it should be defined for both records
-        if (mTransferId.has_value() != o.mTransferId.has_value())
-            return false;
+private:
+    MemoryContextCallback mCallback;
+    SharedState* mSharedState = nullptr;
+
+    static void onAggregateEnd(void* arg)
+    {
+        CbAggregateEnd* end = static_cast<CbAggregateEnd*>(arg);
+        SharedState* sharedState = end->mSharedState;
+        if (sharedState == nullptr)
+            return;
 
-        return mSourceAccount == o.mSourceAccount && mDestinationAccount == o.mDestinationAccount && std::abs(mAmount - o.mAmount) < TRANSFER_AMOUNT_EPSILON;
+        unregister(sharedState);
+        sharedState->validateAtEnd();
     }
-};
 
-template<>
-struct std::hash<PgString> : private std::hash<std::string_view>
-{
-    [[nodiscard]] std::size_t operator()(const PgString& s) const
+    static void onSharedStateRelease(void* arg)
     {
-        return std::hash<std::string_view>::operator()(std::string_view{s});
+        Link* link = static_cast<Link*>(arg);
+        if (link->mEnd != nullptr)
+            link->mEnd->mSharedState = nullptr;
     }
 };
 
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "core.h"
+
+#include <cmath>
+
+// Average cost basis without transfers (ACB0): one position, outputs of a row are the whole state
+struct CbAcb0State
+{
+    double mCostBasisBefore;
+    double mCostBasisAfter;
+    double mBalanceBefore;
+    double mBalanceAfter;
+    double mCapitalGain;
+};
+
+// Cost basis and balance of the initial state, see initcond of cb_acb0
+static constexpr const double ACB0_INITIAL_COST_BASIS = 1.0;
+static constexpr const double ACB0_INITIAL_BALANCE = 0.0;
+
+// One step of the recurrence, shared by the transition function and the batch kernel.
+// Cases are computed with selects instead of branches: trades alternate between opening and closing a position
+// unpredictably, and a select keeps the batch loop free of mispredictions. Price is ignored when amount is 0.
+[[nodiscard]] inline CbAcb0State acb0Step(double costBasis, double balance, double price, double amount)
+{
+    double balanceAfter = balance + amount;
+    if (std::abs(balanceAfter) < AMOUNT_EPSILON)
+        balanceAfter = 0.0;
+
+    // std::signbit - returns false for positives, true for negatives
+    // -- open position, increase position
+    const bool increase = std::signbit(balance) == std::signbit(amount);
+    // close position and cross 0, cost basis becomes equal to price
+    // otherwise close position and do NOT cross 0 volume, cost basis doesn't change as a result
+    const bool cross = std::signbit(balance) != std::signbit(balanceAfter);
+
+    const double increasedCostBasis = balanceAfter == 0.0 ?
+                costBasis :
+                (costBasis * balance + price * amount) / balanceAfter;
+
+    double costBasisAfter = increase ? increasedCostBasis : (cross ? price : costBasis);
+    double capitalGain = increase ? 0.0 : (cross ? balance * (price - costBasis) : amount * (costBasis - price));
+
+    if (amount == 0)
+    {
+        balanceAfter = balance;
+        costBasisAfter = costBasis;
+        capitalGain = 0.0;
+    }
+
+    return CbAcb0State{costBasis, costBasisAfter, balance, balanceAfter, capitalGain};
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "core.h"
+#include "transfers.h"
+
+struct CbAcbAccountEntry
+{
+    double mCostBasis = 1.0;
+    double mAmount = 0;
+};
+
+// Outputs of one row of the average cost basis engine
+struct CbAcbRow
+{
+    double mCostBasisBefore = 1.0;
+    double mCostBasisAfter = 1.0;
+    double mBalanceBefore = 0.0;
+    double mBalanceAfter = 0.0;
+    double mCapitalGain = 0.0;
+};
+
+// Average cost basis engine: every account has one (cost basis, amount) entry, transfers carry cost basis along.
+//
+// Rows are applied with realize, initiateTransfer and finalizeTransfer, they fill the outputs of the row.
+// The capital gain is accumulated, a row that finalizes a transfer may realize several entries.
+template<typename Allocator = std::allocator<char>, CbErrorPolicy Errors = CbThrowErrors>
+class CbAcbBook
+{
+public:
+    using Transfers = CbPendingTransfers<CbAcbAccountEntry, Allocator>;
+
+    explicit CbAcbBook(const Allocator& allocator = Allocator(), const Errors& errors = Errors())
+        : mAccountEntries(allocator)
+        , mTransfers(allocator)
+        , mErrors(errors)
+    {}
+
+    CbAcbBook(const CbAcbBook&) = delete;
+    CbAcbBook& operator=(const CbAcbBook&) = delete;
+
+    // Number of accounts that have an entry, ids of the others have the initial entry
+    [[nodiscard]] size_t numAccounts() const noexcept
+    {
+        return mAccountEntries.size();
+    }
+
+    [[nodiscard]] CbAcbAccountEntry& accountEntry(AccountId account)
+    {
+        if (account >= mAccountEntries.size())
+            mAccountEntries.resize(account + 1);
+        return mAccountEntries[account];
+    }
+
+    [[nodiscard]] const CbAcbAccountEntry& accountEntry(AccountId account) const noexcept
+    {
+        return mAccountEntries[account];
+    }
+
+    [[nodiscard]] Transfers& transfers() noexcept
+    {
+        return mTransfers;
+    }
+
+    [[nodiscard]] const Transfers& transfers() const noexcept
+    {
+        return mTransfers;
+    }
+
+    void realize(AccountId account, double price, double amount, CbAcbRow& row)
+    {
+        realizeImpl(accountEntry(account), price, amount, row);
+    }
+
+    void initiateTransfer(
+            AccountId account, AccountId destinationAccount, std::optional<std::string_view> txId,
+            double amount, std::optional<double> price,
+            int64_t tag, CbAcbRow& row)
+    {
+        CbAcbAccountEntry& entry = accountEntry(account);
+
+        row.mCostBasisBefore = entry.mCostBasis;
+        row.mBalanceBefore = entry.mAmount;
+        row.mBalanceAfter = entry.mAmount + amount;
+        row.mCapitalGain = 0.0;
+
+        if (std::abs(row.mBalanceAfter) < AMOUNT_EPSILON)
+            row.mBalanceAfter = 0.0;
+
+        typename Transfers::Transfer transfer = mTransfers.newTransfer(txId, account, destinationAccount, -amount);
+
+        // Depending on the case we should evaluate
+        // * mCostBasisAfter
+        // * transferred entries
+        // * accountEntry (cost basis and resulting amount)
+        if (row.mBalanceBefore < 0.0)
+        {
+            // We are already negative on the balance. Transfer here is akin to asset acquisition
+            if (!price.has_value())
+            {
+                mErrors.fail(CbError{CbErrorKind::NotEnoughBalanceWhenNegative, tag, account, 0, std::abs(row.mBalanceAfter)});
+                return;
+            }
+            row.mCostBasisAfter = row.mBalanceAfter == 0.0 ?
+                        row.mCostBasisBefore :
+                        (entry.mCostBasis * entry.mAmount + *price * amount) / row.mBalanceAfter;
+
+            transfer.mEntries.push_back({*price, -amount});
+
+            entry.mAmount = row.mBalanceAfter;
+            entry.mCostBasis = row.mCostBasisAfter;
+        }
+        else if (row.mBalanceAfter < 0.0)
+        {
+            // Not enough balance to transfer, we're allowed to go negative if price is specified
+            // Price becomes cost basis for negative position
+            if (!price.has_value())
+            {
+                mErrors.fail(CbError{CbErrorKind::NotEnoughBalance, tag, account, 0, std::abs(row.mBalanceAfter)});
+                return;
+            }
+            row.mCostBasisAfter = *price;
+
+            transfer.mEntries.push_back({row.mCostBasisBefore, row.mBalanceBefore});
+            transfer.mEntries.push_back({row.mCostBasisAfter, -row.mBalanceAfter});
+
+            entry.mAmount = row.mBalanceAfter;
+            entry.mCostBasis = row.mCostBasisAfter;
+        }
+        else
+        {
+            // Enough balance to transfer
+            row.mCostBasisAfter = row.mCostBasisBefore;
+
+            transfer.mEntries.push_back({entry.mCostBasis, -amount});
+
+            entry.mAmount = row.mBalanceAfter;
+        }
+
+        mTransfers.push(std::move(transfer));
+    }
+
+    void finalizeTransfer(AccountId account, AccountId sourceAccount, std::optional<std::string_view> transferId, double amount, int64_t tag,
+                          CbAcbRow& row)
+    {
+        CbAcbAccountEntry& entry = accountEntry(account);
+
+        uint32_t transferSlot = mTransfers.find(transferId, sourceAccount, account, amount);
+        if (transferSlot == Transfers::npos) [[unlikely]]
+        {
+            mErrors.fail(CbError{CbErrorKind::UnmatchedTransfer, tag, account, sourceAccount, amount});
+            return;
+        }
+
+        auto& transfer = mTransfers[transferSlot];
+        if (std::abs(transfer.mAmount - amount) > TRANSFER_AMOUNT_EPSILON) [[unlikely]]
+        {
+            mErrors.fail(CbError{CbErrorKind::TransferAmountMismatch, tag, account, sourceAccount, amount, transfer.mAmount});
+            return;
+        }
+
+        for (auto& e : transfer.mEntries)
+            realizeImpl(entry, e.mCostBasis, e.mAmount, row);
+
+        mTransfers.erase(transferSlot);
+    }
+
+private:
+    CbVector<CbAcbAccountEntry, Allocator> mAccountEntries;
+    Transfers mTransfers;
+    Errors mErrors;
+
+    static void realizeImpl(CbAcbAccountEntry& entry, double price, double amount, CbAcbRow& row)
+    {
+        row.mCostBasisBefore = entry.mCostBasis;
+        row.mBalanceBefore = entry.mAmount;
+        row.mBalanceAfter = entry.mAmount + amount;
+
+        if (std::abs(row.mBalanceAfter) < AMOUNT_EPSILON)
+            row.mBalanceAfter = 0.0;
+
+        // -- open position, increase position
+        if (std::signbit(row.mBalanceBefore) == std::signbit(amount))
+        {
+            row.mCostBasisAfter = row.mBalanceAfter == 0.0 ?
+                        row.mCostBasisBefore :
+                        (entry.mCostBasis * entry.mAmount + price * amount) / row.mBalanceAfter;
+        }
+        // close position and do NOT cross 0 volume
+        // cost basis doesn't change as a result
+        else if (std::signbit(row.mBalanceBefore) == std::signbit(row.mBalanceAfter))
+        {
+            row.mCostBasisAfter = row.mCostBasisBefore;
+            row.mCapitalGain += amount * (row.mCostBasisBefore - price);
+        }
+        // close position and cross 0
+        // cost basis becomes equal to price
+        else
+        {
+            row.mCostBasisAfter = price;
+            row.mCapitalGain += row.mBalanceBefore * (price - row.mCostBasisBefore);
+        }
+
+        entry.mCostBasis = row.mCostBasisAfter;
+        entry.mAmount = row.mBalanceAfter;
+    }
+};
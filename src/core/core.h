@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Cost basis engines without Postgres: plain C++20, header only.
+//
+// Engines keep a book of accounts (lots or average cost basis, pending transfers) and process rows in place.
+// They are parameterized by
+// * Allocator - allocator of char, rebound for every container of the book. std::allocator by default,
+//   the extension plugs in allocators of memory contexts.
+// * Errors - error policy, fail(error) is called for invalid input and must not return. CbThrowErrors by default,
+//   the extension reports errors with ereport.
+//
+// Accounts are dense ids assigned by the caller, the engines never see account names.
+
+// Dense account id
+using AccountId = uint32_t;
+
+// Treat all amounts below AMOUNT_EPSILON as zeros
+static constexpr const double AMOUNT_EPSILON = 1e-11;
+
+// Verify that incoming transfer amount is equal to outgoing transfer amount with the following abs precision
+static constexpr const double TRANSFER_AMOUNT_EPSILON = 1e-8;
+
+// Cost basis methods, values are a part of the snapshot format
+enum class CbMethod : uint8_t
+{
+    Acb = 1,
+    Fifo = 2,
+    Lifo = 3,
+    Hifo = 4,
+    Lofo = 5,
+    SpecId = 6,
+};
+
+template<typename Allocator, typename T>
+using CbRebind = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+template<typename Allocator>
+using CbBasicString = std::basic_string<char, std::char_traits<char>, CbRebind<Allocator, char>>;
+
+template<typename T, typename Allocator>
+using CbVector = std::vector<T, CbRebind<Allocator, T>>;
+
+// Invalid input detected by an engine. Accounts are ids, the error policy turns them into names if it knows them.
+enum class CbErrorKind : uint8_t
+{
+    // Some of the lots selected by the row are not open on mAccount
+    LotsNotOpen,
+    // Withdrawal from mAccount that holds lots of negative amounts
+    TransferFromNegativeBalance,
+    // Withdrawal of more than the balance of mAccount without a price, mAmount is left untransferred
+    NotEnoughBalance,
+    // Same as NotEnoughBalance for an account that is already negative
+    NotEnoughBalanceWhenNegative,
+    // Deposit of mAmount to mAccount from mOtherAccount doesn't match any pending withdrawal
+    UnmatchedTransfer,
+    // Deposit of mAmount finalizes a withdrawal of mOtherAmount
+    TransferAmountMismatch,
+};
+
+struct CbError
+{
+    CbErrorKind mKind;
+    int64_t mTag;
+    AccountId mAccount = 0;
+    AccountId mOtherAccount = 0;
+    double mAmount = 0.0;
+    double mOtherAmount = 0.0;
+};
+
+[[nodiscard]] inline std::string cbErrorMessage(const CbError& error)
+{
+    std::string tag = "tag " + std::to_string(error.mTag) + ": ";
+    switch (error.mKind)
+    {
+    case CbErrorKind::LotsNotOpen:
+        return tag + "some of the selected lots are not open on account " + std::to_string(error.mAccount);
+    case CbErrorKind::TransferFromNegativeBalance:
+        return tag + "attempt to transfer from account " + std::to_string(error.mAccount) + " that has negative balance records";
+    case CbErrorKind::NotEnoughBalance:
+    case CbErrorKind::NotEnoughBalanceWhenNegative:
+        return tag + "not enough balance on account " + std::to_string(error.mAccount) + ", " + std::to_string(error.mAmount) + " left untransfered";
+    case CbErrorKind::UnmatchedTransfer:
+        return tag + "can't finalize transfer " + std::to_string(error.mOtherAccount) + " -> " + std::to_string(error.mAccount) + " " +
+               std::to_string(error.mAmount) + ", unable to match with initiating record";
+    case CbErrorKind::TransferAmountMismatch:
+        return tag + "can't finalize transfer, in/out amounts mismatch: " + std::to_string(error.mOtherAmount) + ", " + std::to_string(error.mAmount);
+    }
+    return tag + "invalid input";
+}
+
+class CbEngineError : public std::runtime_error
+{
+public:
+    explicit CbEngineError(const CbError& error)
+        : std::runtime_error(cbErrorMessage(error))
+        , mError(error)
+    {}
+
+    [[nodiscard]] const CbError& error() const noexcept
+    {
+        return mError;
+    }
+
+private:
+    CbError mError;
+};
+
+// Default error policy. The book is left half updated by the failed row and should be discarded, as in the extension.
+struct CbThrowErrors
+{
+    [[noreturn]] void fail(const CbError& error) const
+    {
+        throw CbEngineError(error);
+    }
+};
+
+template<typename Errors>
+concept CbErrorPolicy = requires(const Errors& errors, const CbError& error) {
+    errors.fail(error);
+};
+
+// Number of open lots, sum of their amounts and sum of their costs
+struct CbLotTotals
+{
+    size_t mLots = 0;
+    double mAmount = 0.0;
+    double mCost = 0.0;
+};
+
+struct CbLotEntry
+{
+    AccountId mOriginatingAccount;
+    int64_t mOriginatingTag;
+    double mCostBasis;
+    double mAmount;
+};
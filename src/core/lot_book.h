@@ -0,0 +1,310 @@
+#pragma once
+
+#include "core.h"
+#include "transfers.h"
+
+#include <algorithm>
+#include <deque>
+#include <span>
+
+// Lot based cost basis engine (FIFO, LIFO, HIFO, LOFO, specific identification).
+//
+// Every account has a store of open lots. Policy decides which lot sells, withdrawals and lots of the opposite sign
+// consume first. It is a compile time parameter, the hot path has neither virtual calls nor branches on the method.
+// Policy provides:
+// * METHOD - CbMethod of snapshots
+// * LotStore<Allocator> - CbLotQueue for methods that match by the order of acquisition, CbLotHeap for methods that
+//   match by cost basis, CbTaggedLotQueue for methods that let rows select lots
+// * next(lots), nextAmount(lots), addToNextAmount(lots, delta), popNext(lots) - access to the lot consumed first
+// * CONSUMES_BACK - lots are consumed in reverse order of acquisition
+// See lot_policies.h for the policies of the supported methods.
+//
+// Rows are applied with realize, initiateTransfer and finalizeTransfer. Lots matched by a row are appended to
+// the realized output given by the caller, the capital gain of a lot is amount * (price - cost basis).
+template<typename Policy, typename Allocator = std::allocator<char>, CbErrorPolicy Errors = CbThrowErrors>
+class CbLotBook
+{
+public:
+    using LotStore = typename Policy::template LotStore<Allocator>;
+    using Transfers = CbPendingTransfers<CbLotEntry, Allocator>;
+
+    // Lot stores allocate from lotsAllocator, accounts and pending transfers from allocator
+    explicit CbLotBook(const Allocator& allocator = Allocator(), const Allocator& lotsAllocator = Allocator(), const Errors& errors = Errors())
+        : mLotsAllocator(lotsAllocator)
+        , mAccountEntries(allocator)
+        , mTransfers(allocator)
+        , mErrors(errors)
+    {}
+
+    CbLotBook(const CbLotBook&) = delete;
+    CbLotBook& operator=(const CbLotBook&) = delete;
+
+    // Number of accounts that have a lot store, ids of the others have no lots
+    [[nodiscard]] size_t numAccounts() const noexcept
+    {
+        return mAccountEntries.size();
+    }
+
+    [[nodiscard]] LotStore& accountLots(AccountId account)
+    {
+        while (account >= mAccountEntries.size())
+            mAccountEntries.emplace_back(mLotsAllocator);
+        return mAccountEntries[account];
+    }
+
+    [[nodiscard]] const LotStore& accountLots(AccountId account) const noexcept
+    {
+        return mAccountEntries[account];
+    }
+
+    // Balance of the account, 0 for accounts without lots
+    [[nodiscard]] double balance(AccountId account) const noexcept
+    {
+        if (account >= mAccountEntries.size())
+            return 0.0;
+        return mAccountEntries[account].totals().mAmount;
+    }
+
+    // Totals over all accounts, kept in sync with the totals of the lot stores
+    [[nodiscard]] const CbLotTotals& totals() const noexcept
+    {
+        return mTotals;
+    }
+
+    [[nodiscard]] Transfers& transfers() noexcept
+    {
+        return mTransfers;
+    }
+
+    [[nodiscard]] const Transfers& transfers() const noexcept
+    {
+        return mTransfers;
+    }
+
+    // Number of lots that were partially consumed by sells or withdrawals and stayed open
+    [[nodiscard]] uint64_t lotsSplit() const noexcept
+    {
+        return mLotsSplit;
+    }
+
+    // Add a lot as is, e.g. restored from a snapshot
+    void pushLot(AccountId account, const CbLotEntry& lot)
+    {
+        LotStore& lots = accountLots(account);
+        const CbLotTotals totalsBefore = lots.totals();
+        lots.push_back(lot);
+        updateTotals(totalsBefore, lots.totals());
+    }
+
+    // Whether a row of the given amount consumes lots of the account, i.e. the account has lots of the opposite sign
+    [[nodiscard]] bool disposes(AccountId account, double amount) const noexcept
+    {
+        if (std::abs(amount) < AMOUNT_EPSILON || account >= mAccountEntries.size() || mAccountEntries[account].empty())
+            return false;
+        return std::signbit(Policy::nextAmount(mAccountEntries[account])) != std::signbit(amount);
+    }
+
+    // Lots that the current row consumes first, only for lot stores that support selection and only for rows that
+    // dispose of lots, see disposes. The selection is dropped by clearSelection.
+    void selectLots(AccountId account, std::span<const int64_t> lotTags, int64_t tag)
+    {
+        LotStore& lots = accountLots(account);
+        if (!lots.select(lotTags)) [[unlikely]]
+        {
+            mErrors.fail(CbError{CbErrorKind::LotsNotOpen, tag, account});
+            return;
+        }
+        mSelectedLots = &lots;
+    }
+
+    void clearSelection() noexcept
+    {
+        if constexpr (requires(LotStore& lots) { lots.clearSelection(); })
+        {
+            if (mSelectedLots != nullptr)
+            {
+                mSelectedLots->clearSelection();
+                mSelectedLots = nullptr;
+            }
+        }
+    }
+
+    template<typename Realized>
+    void realize(AccountId account, double price, double amount, int64_t tag, Realized& realized)
+    {
+        realizeImpl(accountLots(account), account, price, amount, tag, realized);
+    }
+
+    void initiateTransfer(
+            AccountId account, AccountId destinationAccount, std::optional<std::string_view> txId,
+            double amount, std::optional<double> price,
+            int64_t tag)
+    {
+        LotStore& lots = accountLots(account);
+        const CbLotTotals totalsBefore = lots.totals();
+
+        typename Transfers::Transfer transfer = mTransfers.newTransfer(txId, account, destinationAccount, -amount);
+
+        // Amount is always negative because initiating records always withdraw funds
+        double remainingAmountToTransfer = -amount;
+
+        // Policies that can take whole lots in bulk leave only the boundary lot to the loop below
+        if constexpr (requires { Policy::moveNext(lots, remainingAmountToTransfer, transfer.mEntries); })
+            remainingAmountToTransfer = Policy::moveNext(lots, remainingAmountToTransfer, transfer.mEntries);
+
+        while (!lots.empty() && remainingAmountToTransfer >= AMOUNT_EPSILON)
+        {
+            CbLotEntry entry = Policy::next(lots);
+            if (entry.mAmount < AMOUNT_EPSILON) [[unlikely]]
+            {
+                mErrors.fail(CbError{CbErrorKind::TransferFromNegativeBalance, tag, account});
+                return;
+            }
+
+            if (remainingAmountToTransfer > entry.mAmount)
+            {
+                remainingAmountToTransfer -= entry.mAmount;
+                transfer.mEntries.push_back(CbLotEntry{entry.mOriginatingAccount, entry.mOriginatingTag, entry.mCostBasis, entry.mAmount});
+                Policy::popNext(lots);
+            }
+            else
+            {
+                transfer.mEntries.push_back(CbLotEntry{entry.mOriginatingAccount, entry.mOriginatingTag, entry.mCostBasis, remainingAmountToTransfer});
+                double nextAmount = Policy::addToNextAmount(lots, -remainingAmountToTransfer);
+                remainingAmountToTransfer = 0.0;
+                if (nextAmount < AMOUNT_EPSILON)
+                    Policy::popNext(lots);
+                else
+                    ++mLotsSplit;
+            }
+        }
+
+        // Lots are replayed on the destination in the order of the transfer, keep their order of acquisition
+        if constexpr (Policy::CONSUMES_BACK)
+            std::reverse(transfer.mEntries.begin(), transfer.mEntries.end());
+
+        if (remainingAmountToTransfer >= TRANSFER_AMOUNT_EPSILON)
+        {
+            if (price.has_value())
+            {
+                transfer.mEntries.push_back(CbLotEntry{account, tag, *price, remainingAmountToTransfer});
+                lots.push_back(CbLotEntry{account, tag, *price, -remainingAmountToTransfer});
+            }
+            else
+            {
+                mErrors.fail(CbError{CbErrorKind::NotEnoughBalance, tag, account, 0, remainingAmountToTransfer});
+                return;
+            }
+        }
+
+        updateTotals(totalsBefore, lots.totals());
+        mTransfers.push(std::move(transfer));
+    }
+
+    template<typename Realized>
+    void finalizeTransfer(AccountId account, AccountId sourceAccount, std::optional<std::string_view> transferId, double amount, int64_t tag,
+                          Realized& realized)
+    {
+        LotStore& lots = accountLots(account);
+
+        uint32_t transferSlot = mTransfers.find(transferId, sourceAccount, account, amount);
+        if (transferSlot == Transfers::npos) [[unlikely]]
+        {
+            mErrors.fail(CbError{CbErrorKind::UnmatchedTransfer, tag, account, sourceAccount, amount});
+            return;
+        }
+
+        auto& transfer = mTransfers[transferSlot];
+        if (std::abs(transfer.mAmount - amount) > TRANSFER_AMOUNT_EPSILON) [[unlikely]]
+        {
+            mErrors.fail(CbError{CbErrorKind::TransferAmountMismatch, tag, account, sourceAccount, amount, transfer.mAmount});
+            return;
+        }
+
+        // Transferred lots are positive. When there is nothing of the opposite sign to match them against,
+        // lot stores that support it take them in bulk instead of realizing one by one. Either way the lots
+        // become lots of the destination account.
+        bool appended = false;
+        if constexpr (requires(std::span<const CbLotEntry> entries) { lots.append(entries, account); })
+        {
+            if (lots.empty() || !std::signbit(Policy::nextAmount(lots)))
+            {
+                const CbLotTotals totalsBefore = lots.totals();
+                lots.append(transfer.mEntries, account);
+                updateTotals(totalsBefore, lots.totals());
+                appended = true;
+            }
+        }
+
+        if (!appended)
+        {
+            for (auto& e : transfer.mEntries)
+                realizeImpl(lots, account, e.mCostBasis, e.mAmount, e.mOriginatingTag, realized);
+        }
+
+        mTransfers.erase(transferSlot);
+    }
+
+private:
+    using LotStores = std::deque<LotStore, CbRebind<Allocator, LotStore>>;
+
+    Allocator mLotsAllocator;
+    // Indexed by account id, deque keeps references to lot stores valid when new accounts are added
+    LotStores mAccountEntries;
+    Transfers mTransfers;
+    CbLotTotals mTotals;
+    uint64_t mLotsSplit = 0;
+    // Lot store with lots selected by the current row, see selectLots
+    LotStore* mSelectedLots = nullptr;
+    Errors mErrors;
+
+    // Fold the change of one store's totals into the totals over all accounts
+    void updateTotals(const CbLotTotals& before, const CbLotTotals& after) noexcept
+    {
+        mTotals.mLots += after.mLots - before.mLots;
+        mTotals.mAmount += after.mAmount - before.mAmount;
+        mTotals.mCost += after.mCost - before.mCost;
+
+        if (mTotals.mLots == 0)
+            mTotals = CbLotTotals{};
+    }
+
+    template<typename Realized>
+    void realizeImpl(LotStore& lots, AccountId account, double price, double amount, int64_t tag, Realized& realized)
+    {
+        if (std::abs(amount) < AMOUNT_EPSILON)
+            return;
+
+        const CbLotTotals totalsBefore = lots.totals();
+
+        double remainingAmount = amount;
+
+        while (std::abs(remainingAmount) >= AMOUNT_EPSILON && !lots.empty() && std::signbit(Policy::nextAmount(lots)) != std::signbit(remainingAmount))
+        {
+            CbLotEntry entry = Policy::next(lots);
+            if (std::signbit(entry.mAmount) == std::signbit(entry.mAmount + remainingAmount))
+            {
+                // don't cross 0
+                realized.push_back(CbLotEntry{entry.mOriginatingAccount, entry.mOriginatingTag, entry.mCostBasis, -remainingAmount});
+                double nextAmount = Policy::addToNextAmount(lots, remainingAmount);
+                remainingAmount = 0.0;
+                if (std::abs(nextAmount) < AMOUNT_EPSILON)
+                    Policy::popNext(lots);
+                else
+                    ++mLotsSplit;
+            }
+            else
+            {
+                // cross 0
+                realized.push_back(CbLotEntry{entry.mOriginatingAccount, entry.mOriginatingTag, entry.mCostBasis, entry.mAmount});
+                remainingAmount += entry.mAmount;
+                Policy::popNext(lots);
+            }
+        }
+
+        if (std::abs(remainingAmount) >= AMOUNT_EPSILON)
+            lots.push_back(CbLotEntry{account, tag, price, remainingAmount});
+
+        updateTotals(totalsBefore, lots.totals());
+    }
+};
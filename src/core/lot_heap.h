@@ -0,0 +1,170 @@
+#pragma once
+
+#include "core.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Lots of one account ordered by a priority, the lot that Before puts first is consumed first.
+//
+// 4-ary min-heap in a flat array: push and pop are O(log lots), the first lot is always at index 0.
+// A heap of arity 4 is half as deep as a binary one and the children of a node share a cache line or two.
+// Partial consumption of the first lot only updates its amount, priority is derived from cost basis and tag
+// which never change, so no sift is needed.
+//
+// Totals of amounts and costs are maintained incrementally exactly as in CbLotQueue. Interface mirrors
+// CbLotQueue, so both can be used as the lot store of CbLotState.
+//
+// Lot is any aggregate with mOriginatingAccount, mOriginatingTag, mCostBasis and mAmount members.
+// Before is a stateless strict weak ordering of lots.
+template<typename Lot, typename Before, typename Allocator = std::allocator<char>>
+class CbLotHeap
+{
+public:
+    explicit CbLotHeap(const Allocator& allocator = Allocator()) noexcept
+        : mAllocator(allocator)
+    {}
+
+    CbLotHeap(const CbLotHeap&) = delete;
+    CbLotHeap& operator=(const CbLotHeap&) = delete;
+
+    ~CbLotHeap()
+    {
+        if (mCapacity != 0)
+            mAllocator.deallocate(mLots, mCapacity);
+    }
+
+    [[nodiscard]] bool empty() const noexcept
+    {
+        return mSize == 0;
+    }
+
+    [[nodiscard]] size_t size() const noexcept
+    {
+        return mSize;
+    }
+
+    [[nodiscard]] const Lot& top() const noexcept
+    {
+        return mLots[0];
+    }
+
+    [[nodiscard]] double topAmount() const noexcept
+    {
+        return mLots[0].mAmount;
+    }
+
+    // First lot is partially consumed by updating its amount in place, returns the new amount
+    double addToTopAmount(double delta) noexcept
+    {
+        mTotals.mAmount += delta;
+        mTotals.mCost += delta * mLots[0].mCostBasis;
+        return mLots[0].mAmount += delta;
+    }
+
+    // Named after CbLotQueue::push_back, the lot takes its place according to Before
+    void push_back(const Lot& lot)
+    {
+        if (mSize == mCapacity)
+            grow();
+
+        siftUp(mSize, lot);
+        ++mSize;
+
+        ++mTotals.mLots;
+        mTotals.mAmount += lot.mAmount;
+        mTotals.mCost += lot.mAmount * lot.mCostBasis;
+    }
+
+    void pop() noexcept
+    {
+        --mTotals.mLots;
+        mTotals.mAmount -= mLots[0].mAmount;
+        mTotals.mCost -= mLots[0].mAmount * mLots[0].mCostBasis;
+
+        --mSize;
+
+        // Don't let rounding errors of running sums outlive the lots
+        if (mSize == 0)
+            mTotals = CbLotTotals{};
+        else
+            siftDown(0, mLots[mSize]);
+    }
+
+    [[nodiscard]] const CbLotTotals& totals() const noexcept
+    {
+        return mTotals;
+    }
+
+    // Visit lots in heap order, pushing them in this order into an empty heap rebuilds the same heap
+    template<typename Func>
+    void forEach(Func&& func) const
+    {
+        for (size_t i = 0; i < mSize; ++i)
+            func(mLots[i]);
+    }
+
+private:
+    static constexpr size_t ARITY = 4;
+
+    CbRebind<Allocator, Lot> mAllocator;
+    Lot* mLots = nullptr;
+    size_t mSize = 0;
+    size_t mCapacity = 0;
+    CbLotTotals mTotals;
+
+    // Move the hole at index up until lot can be placed into it
+    void siftUp(size_t index, const Lot& lot) noexcept
+    {
+        while (index > 0)
+        {
+            size_t parent = (index - 1) / ARITY;
+            if (!Before{}(lot, mLots[parent]))
+                break;
+            mLots[index] = mLots[parent];
+            index = parent;
+        }
+        mLots[index] = lot;
+    }
+
+    // Move the hole at index down until lot can be placed into it
+    void siftDown(size_t index, Lot lot) noexcept
+    {
+        for (;;)
+        {
+            size_t first = index * ARITY + 1;
+            if (first >= mSize)
+                break;
+
+            size_t last = std::min(first + ARITY, mSize);
+            size_t best = first;
+            for (size_t child = first + 1; child < last; ++child)
+            {
+                if (Before{}(mLots[child], mLots[best]))
+                    best = child;
+            }
+
+            if (!Before{}(mLots[best], lot))
+                break;
+
+            mLots[index] = mLots[best];
+            index = best;
+        }
+        mLots[index] = lot;
+    }
+
+    void grow()
+    {
+        size_t capacity = std::max<size_t>(16, mCapacity * 2);
+
+        Lot* lots = mAllocator.allocate(capacity);
+        if (mSize != 0)
+            std::memcpy(lots, mLots, mSize * sizeof(Lot));
+
+        if (mCapacity != 0)
+            mAllocator.deallocate(mLots, mCapacity);
+
+        mLots = lots;
+        mCapacity = capacity;
+    }
+};
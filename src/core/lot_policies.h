@@ -0,0 +1,148 @@
+#pragma once
+
+#include "core.h"
+#include "lot_queue.h"
+#include "lot_heap.h"
+#include "tagged_lot_queue.h"
+
+// Matching policies of the lot based methods, see CbLotBook
+
+// Lots are matched in the order of acquisition
+struct CbFifoPolicy
+{
+    static constexpr CbMethod METHOD = CbMethod::Fifo;
+
+    template<typename Allocator>
+    using LotStore = CbLotQueue<CbLotEntry, Allocator>;
+
+    static constexpr bool CONSUMES_BACK = false;
+
+    template<typename Lots>
+    [[nodiscard]] static auto next(const Lots& lots) noexcept { return lots.front(); }
+
+    template<typename Lots>
+    [[nodiscard]] static double nextAmount(const Lots& lots) noexcept { return lots.frontAmount(); }
+
+    template<typename Lots>
+    static double addToNextAmount(Lots& lots, double delta) noexcept { return lots.addToFrontAmount(delta); }
+
+    template<typename Lots>
+    static void popNext(Lots& lots) noexcept { lots.pop_front(); }
+
+    template<typename Lots, typename Entries>
+    [[nodiscard]] static double moveNext(Lots& lots, double amount, Entries& out) { return lots.moveFront(amount, out); }
+};
+
+// The most recently acquired lot is matched first
+struct CbLifoPolicy
+{
+    static constexpr CbMethod METHOD = CbMethod::Lifo;
+
+    template<typename Allocator>
+    using LotStore = CbLotQueue<CbLotEntry, Allocator>;
+
+    static constexpr bool CONSUMES_BACK = true;
+
+    template<typename Lots>
+    [[nodiscard]] static auto next(const Lots& lots) noexcept { return lots.back(); }
+
+    template<typename Lots>
+    [[nodiscard]] static double nextAmount(const Lots& lots) noexcept { return lots.backAmount(); }
+
+    template<typename Lots>
+    static double addToNextAmount(Lots& lots, double delta) noexcept { return lots.addToBackAmount(delta); }
+
+    template<typename Lots>
+    static void popNext(Lots& lots) noexcept { lots.pop_back(); }
+};
+
+// The lot with the highest cost basis is matched first, the oldest one among lots of the same cost basis
+struct CbHifoOrder
+{
+    [[nodiscard]] bool operator()(const CbLotEntry& a, const CbLotEntry& b) const noexcept
+    {
+        if (a.mCostBasis != b.mCostBasis)
+            return a.mCostBasis > b.mCostBasis;
+        return a.mOriginatingTag < b.mOriginatingTag;
+    }
+};
+
+struct CbHifoPolicy
+{
+    static constexpr CbMethod METHOD = CbMethod::Hifo;
+
+    template<typename Allocator>
+    using LotStore = CbLotHeap<CbLotEntry, CbHifoOrder, Allocator>;
+
+    // Order of transferred lots doesn't matter, the destination orders them by cost basis
+    static constexpr bool CONSUMES_BACK = false;
+
+    template<typename Lots>
+    [[nodiscard]] static auto next(const Lots& lots) noexcept { return lots.top(); }
+
+    template<typename Lots>
+    [[nodiscard]] static double nextAmount(const Lots& lots) noexcept { return lots.topAmount(); }
+
+    template<typename Lots>
+    static double addToNextAmount(Lots& lots, double delta) noexcept { return lots.addToTopAmount(delta); }
+
+    template<typename Lots>
+    static void popNext(Lots& lots) noexcept { lots.pop(); }
+};
+
+// The lot with the lowest cost basis is matched first, the oldest one among lots of the same cost basis
+struct CbLofoOrder
+{
+    [[nodiscard]] bool operator()(const CbLotEntry& a, const CbLotEntry& b) const noexcept
+    {
+        if (a.mCostBasis != b.mCostBasis)
+            return a.mCostBasis < b.mCostBasis;
+        return a.mOriginatingTag < b.mOriginatingTag;
+    }
+};
+
+struct CbLofoPolicy
+{
+    static constexpr CbMethod METHOD = CbMethod::Lofo;
+
+    template<typename Allocator>
+    using LotStore = CbLotHeap<CbLotEntry, CbLofoOrder, Allocator>;
+
+    // Order of transferred lots doesn't matter, the destination orders them by cost basis
+    static constexpr bool CONSUMES_BACK = false;
+
+    template<typename Lots>
+    [[nodiscard]] static auto next(const Lots& lots) noexcept { return lots.top(); }
+
+    template<typename Lots>
+    [[nodiscard]] static double nextAmount(const Lots& lots) noexcept { return lots.topAmount(); }
+
+    template<typename Lots>
+    static double addToNextAmount(Lots& lots, double delta) noexcept { return lots.addToTopAmount(delta); }
+
+    template<typename Lots>
+    static void popNext(Lots& lots) noexcept { lots.pop(); }
+};
+
+// Lots selected by the row are matched first, then lots in the order of acquisition
+struct CbSpecIdPolicy
+{
+    static constexpr CbMethod METHOD = CbMethod::SpecId;
+
+    template<typename Allocator>
+    using LotStore = CbTaggedLotQueue<CbLotEntry, Allocator>;
+
+    static constexpr bool CONSUMES_BACK = false;
+
+    template<typename Lots>
+    [[nodiscard]] static auto next(const Lots& lots) noexcept { return lots.next(); }
+
+    template<typename Lots>
+    [[nodiscard]] static double nextAmount(const Lots& lots) noexcept { return lots.nextAmount(); }
+
+    template<typename Lots>
+    static double addToNextAmount(Lots& lots, double delta) noexcept { return lots.addToNextAmount(delta); }
+
+    template<typename Lots>
+    static void popNext(Lots& lots) { lots.popNext(); }
+};
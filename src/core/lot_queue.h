@@ -0,0 +1,277 @@
+#pragma once
+
+#include "core.h"
+
+#include <algorithm>
+#include <cstring>
+#include <span>
+
+// Queue of lots of one account.
+//
+// Lots are stored as structure of arrays in a ring buffer: amounts, cost bases, tags and originating accounts live in
+// separate contiguous arrays of the same power of two capacity. Matching walks the amounts from either end without
+// touching the rest of the lot. Partial consumption of the front or back lot is an in-place update of its amount.
+//
+// Totals of amounts and costs (amount * cost basis) are maintained incrementally as lots are pushed, updated and popped,
+// so balances never require a scan.
+//
+// Lot is any aggregate with mOriginatingAccount, mOriginatingTag, mCostBasis and mAmount members.
+// Allocator is rebound to char, the arrays share one buffer.
+template<typename Lot, typename Allocator = std::allocator<char>>
+class CbLotQueue
+{
+public:
+    explicit CbLotQueue(const Allocator& allocator = Allocator()) noexcept
+        : mAllocator(allocator)
+    {}
+
+    CbLotQueue(const CbLotQueue&) = delete;
+    CbLotQueue& operator=(const CbLotQueue&) = delete;
+
+    ~CbLotQueue()
+    {
+        if (mCapacity != 0)
+            mAllocator.deallocate(mBuffer, bufferSize(mCapacity));
+    }
+
+    [[nodiscard]] bool empty() const noexcept
+    {
+        return mSize == 0;
+    }
+
+    [[nodiscard]] size_t size() const noexcept
+    {
+        return mSize;
+    }
+
+    [[nodiscard]] Lot front() const noexcept
+    {
+        return at(mHead);
+    }
+
+    [[nodiscard]] double frontAmount() const noexcept
+    {
+        return mAmounts[mHead];
+    }
+
+    // Front lot is partially consumed by updating its amount in place, returns the new amount
+    double addToFrontAmount(double delta) noexcept
+    {
+        mTotals.mAmount += delta;
+        mTotals.mCost += delta * mCostBases[mHead];
+        return mAmounts[mHead] += delta;
+    }
+
+    [[nodiscard]] Lot back() const noexcept
+    {
+        return at(tail());
+    }
+
+    [[nodiscard]] double backAmount() const noexcept
+    {
+        return mAmounts[tail()];
+    }
+
+    // Back lot is partially consumed by updating its amount in place, returns the new amount
+    double addToBackAmount(double delta) noexcept
+    {
+        size_t i = tail();
+        mTotals.mAmount += delta;
+        mTotals.mCost += delta * mCostBases[i];
+        return mAmounts[i] += delta;
+    }
+
+    void push_back(const Lot& lot)
+    {
+        if (mSize == mCapacity)
+            grow(mSize + 1);
+
+        size_t i = (mHead + mSize) & (mCapacity - 1);
+        mAmounts[i] = lot.mAmount;
+        mCostBases[i] = lot.mCostBasis;
+        mTags[i] = lot.mOriginatingTag;
+        mAccounts[i] = lot.mOriginatingAccount;
+        ++mSize;
+
+        ++mTotals.mLots;
+        mTotals.mAmount += lot.mAmount;
+        mTotals.mCost += lot.mAmount * lot.mCostBasis;
+    }
+
+    void pop_front() noexcept
+    {
+        --mTotals.mLots;
+        mTotals.mAmount -= mAmounts[mHead];
+        mTotals.mCost -= mAmounts[mHead] * mCostBases[mHead];
+
+        mHead = (mHead + 1) & (mCapacity - 1);
+        --mSize;
+
+        // Don't let rounding errors of running sums outlive the lots
+        if (mSize == 0)
+            mTotals = CbLotTotals{};
+    }
+
+    // Move whole lots from the front to out while they are smaller than the remaining amount, returns the remaining
+    // amount. Only amounts are compared, the lots are copied out and popped in bulk. The lot that doesn't fit,
+    // if any, is left at the front to be split by the caller. Stops at non-positive lots too.
+    template<typename Entries>
+    [[nodiscard]] double moveFront(double amount, Entries& out)
+    {
+        size_t count = 0;
+        double movedAmount = 0.0;
+        double movedCost = 0.0;
+        for (; count < mSize; ++count)
+        {
+            size_t i = (mHead + count) & (mCapacity - 1);
+            if (mAmounts[i] < AMOUNT_EPSILON || amount <= mAmounts[i])
+                break;
+            amount -= mAmounts[i];
+            movedAmount += mAmounts[i];
+            movedCost += mAmounts[i] * mCostBases[i];
+        }
+
+        if (count == 0)
+            return amount;
+
+        out.reserve(out.size() + count);
+        for (size_t n = 0; n < count; ++n)
+            out.push_back(at((mHead + n) & (mCapacity - 1)));
+
+        mHead = (mHead + count) & (mCapacity - 1);
+        mSize -= count;
+
+        mTotals.mLots -= count;
+        mTotals.mAmount -= movedAmount;
+        mTotals.mCost -= movedCost;
+        if (mSize == 0)
+            mTotals = CbLotTotals{};
+
+        return amount;
+    }
+
+    // Append lots to the back as lots of account, the buffer grows at most once
+    void append(std::span<const Lot> lots, AccountId account)
+    {
+        if (mSize + lots.size() > mCapacity)
+            grow(mSize + lots.size());
+
+        for (const Lot& lot : lots)
+        {
+            size_t i = (mHead + mSize) & (mCapacity - 1);
+            mAmounts[i] = lot.mAmount;
+            mCostBases[i] = lot.mCostBasis;
+            mTags[i] = lot.mOriginatingTag;
+            mAccounts[i] = account;
+            ++mSize;
+
+            mTotals.mAmount += lot.mAmount;
+            mTotals.mCost += lot.mAmount * lot.mCostBasis;
+        }
+        mTotals.mLots += lots.size();
+    }
+
+    void pop_back() noexcept
+    {
+        size_t i = tail();
+        --mTotals.mLots;
+        mTotals.mAmount -= mAmounts[i];
+        mTotals.mCost -= mAmounts[i] * mCostBases[i];
+
+        --mSize;
+
+        if (mSize == 0)
+            mTotals = CbLotTotals{};
+    }
+
+    [[nodiscard]] const CbLotTotals& totals() const noexcept
+    {
+        return mTotals;
+    }
+
+    // Visit lots front to back
+    template<typename Func>
+    void forEach(Func&& func) const
+    {
+        for (size_t n = 0; n < mSize; ++n)
+            func(at((mHead + n) & (mCapacity - 1)));
+    }
+
+private:
+    using Range = std::pair<size_t, size_t>;
+
+    CbRebind<Allocator, char> mAllocator;
+    char* mBuffer = nullptr;
+    double* mAmounts = nullptr;
+    double* mCostBases = nullptr;
+    int64_t* mTags = nullptr;
+    AccountId* mAccounts = nullptr;
+    size_t mHead = 0;
+    size_t mSize = 0;
+    size_t mCapacity = 0;
+    CbLotTotals mTotals;
+
+    [[nodiscard]] static size_t bufferSize(size_t capacity) noexcept
+    {
+        return capacity * (sizeof(double) + sizeof(double) + sizeof(int64_t) + sizeof(AccountId));
+    }
+
+    [[nodiscard]] size_t tail() const noexcept
+    {
+        return (mHead + mSize - 1) & (mCapacity - 1);
+    }
+
+    [[nodiscard]] Lot at(size_t i) const noexcept
+    {
+        return Lot{mAccounts[i], mTags[i], mCostBases[i], mAmounts[i]};
+    }
+
+    // Occupied part of the ring buffer as two ranges of indexes, the second one is empty unless the queue wraps around
+    [[nodiscard]] std::pair<Range, Range> ranges() const noexcept
+    {
+        size_t end = mHead + mSize;
+        if (end <= mCapacity)
+            return {Range{mHead, end}, Range{0, 0}};
+        return {Range{mHead, mCapacity}, Range{0, end - mCapacity}};
+    }
+
+    // Capacity stays a power of two not smaller than minCapacity
+    void grow(size_t minCapacity)
+    {
+        size_t capacity = std::max<size_t>(16, mCapacity * 2);
+        while (capacity < minCapacity)
+            capacity *= 2;
+
+        char* buffer = mAllocator.allocate(bufferSize(capacity));
+        double* amounts = reinterpret_cast<double*>(buffer);
+        double* costBases = amounts + capacity;
+        int64_t* tags = reinterpret_cast<int64_t*>(costBases + capacity);
+        AccountId* accounts = reinterpret_cast<AccountId*>(tags + capacity);
+
+        // Unwrap the queue to the beginning of the new arrays
+        size_t offset = 0;
+        auto [first, second] = ranges();
+        for (Range r : {first, second})
+        {
+            size_t n = r.second - r.first;
+            if (n == 0)
+                continue;
+            std::memcpy(amounts + offset, mAmounts + r.first, n * sizeof(double));
+            std::memcpy(costBases + offset, mCostBases + r.first, n * sizeof(double));
+            std::memcpy(tags + offset, mTags + r.first, n * sizeof(int64_t));
+            std::memcpy(accounts + offset, mAccounts + r.first, n * sizeof(AccountId));
+            offset += n;
+        }
+
+        if (mCapacity != 0)
+            mAllocator.deallocate(mBuffer, bufferSize(mCapacity));
+
+        mBuffer = buffer;
+        mAmounts = amounts;
+        mCostBases = costBases;
+        mTags = tags;
+        mAccounts = accounts;
+        mHead = 0;
+        mCapacity = capacity;
+    }
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "core.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+// Queue of lots of one account with lookup by originating tag, for specific identification.
+//
+// Lots are consumed in the order of acquisition unless a row selects them explicitly: select() resolves the tags
+// to lot positions through the tag index, so the selected lots are consumed first in O(k) for k selected lots.
+// When the selected lots are exhausted matching falls back to the front of the queue.
+//
+// Lots consumed out of order are left in place as tombstones and skipped when they reach the front. Once tombstones
+// make up half of the queue they are dropped in one pass, positions in the tag index and the selection are remapped,
+// so tombstones of lots selected far from the front don't accumulate.
+//
+// Totals are maintained incrementally exactly as in CbLotQueue. Interface mirrors CbLotQueue, so both can be used
+// as the lot store of CbLotState.
+//
+// Lot is any aggregate with mOriginatingAccount, mOriginatingTag, mCostBasis and mAmount members.
+template<typename Lot, typename Allocator = std::allocator<char>>
+class CbTaggedLotQueue
+{
+public:
+    // Index of a lot in the queue, including tombstones
+    using Position = size_t;
+
+    explicit CbTaggedLotQueue(const Allocator& allocator = Allocator())
+        : mLots(allocator)
+        , mByTag(0, std::hash<int64_t>{}, std::equal_to<int64_t>{}, allocator)
+        , mSelection(allocator)
+    {}
+
+    CbTaggedLotQueue(const CbTaggedLotQueue&) = delete;
+    CbTaggedLotQueue& operator=(const CbTaggedLotQueue&) = delete;
+
+    [[nodiscard]] bool empty() const noexcept
+    {
+        return mSize == 0;
+    }
+
+    [[nodiscard]] size_t size() const noexcept
+    {
+        return mSize;
+    }
+
+    // The first selected lot or the front lot when there is no selection
+    [[nodiscard]] const Lot& next() const noexcept
+    {
+        return mLots[nextIndex()];
+    }
+
+    [[nodiscard]] double nextAmount() const noexcept
+    {
+        return mLots[nextIndex()].mAmount;
+    }
+
+    // Next lot is partially consumed by updating its amount in place, returns the new amount
+    double addToNextAmount(double delta) noexcept
+    {
+        Lot& lot = mLots[nextIndex()];
+        mTotals.mAmount += delta;
+        mTotals.mCost += delta * lot.mCostBasis;
+        return lot.mAmount += delta;
+    }
+
+    void push_back(const Lot& lot)
+    {
+        Position position = mLots.size();
+        mLots.push_back(lot);
+        mByTag.try_emplace(lot.mOriginatingTag, mLots.get_allocator()).first->second.push_back(position);
+        ++mSize;
+
+        ++mTotals.mLots;
+        mTotals.mAmount += lot.mAmount;
+        mTotals.mCost += lot.mAmount * lot.mCostBasis;
+    }
+
+    void popNext()
+    {
+        size_t index = nextIndex();
+        bool selected = mSelectionCursor < mSelection.size();
+        kill(index);
+
+        if (selected)
+            skipConsumedSelection();
+        skipConsumedFront();
+
+        size_t numConsumed = mLots.size() - mSize;
+        if (numConsumed >= COMPACT_THRESHOLD && numConsumed * 2 >= mLots.size())
+            compact();
+    }
+
+    // Lots with the given tags are consumed first, in the order of tags, lots with the same tag in the order of
+    // acquisition. Returns false if some tag has no open lot, the selection is left empty then.
+    [[nodiscard]] bool select(std::span<const int64_t> tags)
+    {
+        clearSelection();
+        for (int64_t tag : tags)
+        {
+            auto it = mByTag.find(tag);
+            if (it == mByTag.end())
+            {
+                clearSelection();
+                return false;
+            }
+            mSelection.insert(mSelection.end(), it->second.begin(), it->second.end());
+        }
+        // Same tag may be listed twice
+        skipConsumedSelection();
+        return true;
+    }
+
+    void clearSelection() noexcept
+    {
+        mSelection.clear();
+        mSelectionCursor = 0;
+    }
+
+    [[nodiscard]] const CbLotTotals& totals() const noexcept
+    {
+        return mTotals;
+    }
+
+    // Visit open lots front to back
+    template<typename Func>
+    void forEach(Func&& func) const
+    {
+        for (size_t i = mHead; i < mLots.size(); ++i)
+        {
+            if (!isConsumed(mLots[i]))
+                func(mLots[i]);
+        }
+    }
+
+private:
+    using LotVector = CbVector<Lot, Allocator>;
+    using PositionVector = CbVector<Position, Allocator>;
+    using TagIndex = std::unordered_map<int64_t, PositionVector, std::hash<int64_t>, std::equal_to<int64_t>,
+                                        CbRebind<Allocator, std::pair<const int64_t, PositionVector>>>;
+
+    // Consumed lots are marked with an account id that is never assigned
+    static constexpr AccountId CONSUMED = std::numeric_limits<AccountId>::max();
+
+    // Drop tombstones once there are at least this many and they make up half of the queue
+    static constexpr size_t COMPACT_THRESHOLD = 64;
+
+    // Position of a tombstone in the remapping of compact
+    static constexpr Position DROPPED = std::numeric_limits<Position>::max();
+
+    LotVector mLots;
+    // Index of the first open lot
+    size_t mHead = 0;
+    size_t mSize = 0;
+    // Positions of open lots for each tag, in the order of acquisition
+    TagIndex mByTag;
+    // Positions of selected lots and the first one that is not consumed yet
+    PositionVector mSelection;
+    size_t mSelectionCursor = 0;
+    CbLotTotals mTotals;
+
+    [[nodiscard]] static bool isConsumed(const Lot& lot) noexcept
+    {
+        return lot.mOriginatingAccount == CONSUMED;
+    }
+
+    [[nodiscard]] size_t nextIndex() const noexcept
+    {
+        if (mSelectionCursor < mSelection.size())
+            return mSelection[mSelectionCursor];
+        return mHead;
+    }
+
+    void kill(size_t index) noexcept
+    {
+        Lot& lot = mLots[index];
+
+        --mTotals.mLots;
+        mTotals.mAmount -= lot.mAmount;
+        mTotals.mCost -= lot.mAmount * lot.mCostBasis;
+        --mSize;
+
+        auto it = mByTag.find(lot.mOriginatingTag);
+        PositionVector& positions = it->second;
+        positions.erase(std::find(positions.begin(), positions.end(), index));
+        if (positions.empty())
+            mByTag.erase(it);
+
+        lot.mOriginatingAccount = CONSUMED;
+
+        // Don't let rounding errors of running sums outlive the lots
+        if (mSize == 0)
+            mTotals = CbLotTotals{};
+    }
+
+    void skipConsumedSelection() noexcept
+    {
+        while (mSelectionCursor < mSelection.size() && isConsumed(mLots[mSelection[mSelectionCursor]]))
+            ++mSelectionCursor;
+    }
+
+    void skipConsumedFront() noexcept
+    {
+        while (mHead < mLots.size() && isConsumed(mLots[mHead]))
+            ++mHead;
+    }
+
+    // Drop all tombstones, open lots keep their order. The tag index only refers to open lots, the rest of the selection
+    // loses the positions of consumed lots.
+    void compact()
+    {
+        PositionVector remapped(mLots.size(), DROPPED, mSelection.get_allocator());
+        Position open = 0;
+        for (size_t i = mHead; i < mLots.size(); ++i)
+        {
+            if (isConsumed(mLots[i]))
+                continue;
+            remapped[i] = open;
+            mLots[open++] = mLots[i];
+        }
+        mLots.erase(mLots.begin() + static_cast<std::ptrdiff_t>(open), mLots.end());
+        mHead = 0;
+
+        for (auto& [tag, positions] : mByTag)
+        {
+            for (Position& position : positions)
+                position = remapped[position];
+        }
+
+        size_t selected = 0;
+        for (size_t i = mSelectionCursor; i < mSelection.size(); ++i)
+        {
+            if (remapped[mSelection[i]] != DROPPED)
+                mSelection[selected++] = remapped[mSelection[i]];
+        }
+        mSelection.erase(mSelection.begin() + static_cast<std::ptrdiff_t>(selected), mSelection.end());
+        mSelectionCursor = 0;
+    }
+};
@@ -0,0 +1,264 @@
+// Randomized comparison of CbLotBook against a straightforward model of the lot based methods.
+//
+// The model keeps lots of every account in a std::deque and applies every row lot by lot, as the engine did before
+// transfers were moved in bulk. After every row the open lots of all accounts, including the account each lot belongs to,
+// and the realized entries of the row must be identical.
+
+#include "lot_book.h"
+#include "lot_policies.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+int gFailures = 0;
+
+#define CHECK(condition, ...)                                                \
+    do                                                                       \
+    {                                                                        \
+        if (!(condition))                                                    \
+        {                                                                    \
+            std::fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #condition); \
+            std::fprintf(stderr, __VA_ARGS__);                               \
+            std::fprintf(stderr, "\n");                                      \
+            ++gFailures;                                                     \
+            return;                                                          \
+        }                                                                    \
+    } while (false)
+
+struct ModelTransfer
+{
+    std::string mId;
+    std::vector<CbLotEntry> mEntries;
+};
+
+// FIFO, or LIFO when ConsumesBack
+template<bool ConsumesBack>
+class LotModel
+{
+public:
+    explicit LotModel(size_t numAccounts)
+        : mAccounts(numAccounts)
+    {}
+
+    [[nodiscard]] const std::deque<CbLotEntry>& lots(AccountId account) const
+    {
+        return mAccounts[account];
+    }
+
+    void realize(AccountId account, double price, double amount, int64_t tag, std::vector<CbLotEntry>& realized)
+    {
+        std::deque<CbLotEntry>& lots = mAccounts[account];
+        if (std::abs(amount) < AMOUNT_EPSILON)
+            return;
+
+        double remaining = amount;
+        while (std::abs(remaining) >= AMOUNT_EPSILON && !lots.empty() && std::signbit(next(lots).mAmount) != std::signbit(remaining))
+        {
+            CbLotEntry& lot = next(lots);
+            if (std::signbit(lot.mAmount) == std::signbit(lot.mAmount + remaining))
+            {
+                realized.push_back(CbLotEntry{lot.mOriginatingAccount, lot.mOriginatingTag, lot.mCostBasis, -remaining});
+                lot.mAmount += remaining;
+                remaining = 0.0;
+                if (std::abs(lot.mAmount) < AMOUNT_EPSILON)
+                    popNext(lots);
+            }
+            else
+            {
+                realized.push_back(lot);
+                remaining += lot.mAmount;
+                popNext(lots);
+            }
+        }
+
+        if (std::abs(remaining) >= AMOUNT_EPSILON)
+            lots.push_back(CbLotEntry{account, tag, price, remaining});
+    }
+
+    void initiateTransfer(AccountId account, const std::string& id, double amount, double price, int64_t tag)
+    {
+        std::deque<CbLotEntry>& lots = mAccounts[account];
+        ModelTransfer transfer{id, {}};
+
+        double remaining = -amount;
+        while (!lots.empty() && remaining >= AMOUNT_EPSILON)
+        {
+            CbLotEntry& lot = next(lots);
+            if (remaining > lot.mAmount)
+            {
+                remaining -= lot.mAmount;
+                transfer.mEntries.push_back(lot);
+                popNext(lots);
+            }
+            else
+            {
+                transfer.mEntries.push_back(CbLotEntry{lot.mOriginatingAccount, lot.mOriginatingTag, lot.mCostBasis, remaining});
+                lot.mAmount -= remaining;
+                remaining = 0.0;
+                if (lot.mAmount < AMOUNT_EPSILON)
+                    popNext(lots);
+            }
+        }
+
+        if constexpr (ConsumesBack)
+            std::reverse(transfer.mEntries.begin(), transfer.mEntries.end());
+
+        if (remaining >= TRANSFER_AMOUNT_EPSILON)
+        {
+            transfer.mEntries.push_back(CbLotEntry{account, tag, price, remaining});
+            lots.push_back(CbLotEntry{account, tag, price, -remaining});
+        }
+
+        mTransfers.push_back(std::move(transfer));
+    }
+
+    void finalizeTransfer(AccountId account, const std::string& id, std::vector<CbLotEntry>& realized)
+    {
+        for (auto it = mTransfers.begin(); it != mTransfers.end(); ++it)
+        {
+            if (it->mId != id)
+                continue;
+
+            for (const CbLotEntry& e : it->mEntries)
+                realize(account, e.mCostBasis, e.mAmount, e.mOriginatingTag, realized);
+            mTransfers.erase(it);
+            return;
+        }
+    }
+
+private:
+    std::vector<std::deque<CbLotEntry>> mAccounts;
+    std::vector<ModelTransfer> mTransfers;
+
+    [[nodiscard]] static CbLotEntry& next(std::deque<CbLotEntry>& lots)
+    {
+        return ConsumesBack ? lots.back() : lots.front();
+    }
+
+    static void popNext(std::deque<CbLotEntry>& lots)
+    {
+        if constexpr (ConsumesBack)
+            lots.pop_back();
+        else
+            lots.pop_front();
+    }
+};
+
+[[nodiscard]] bool sameLot(const CbLotEntry& a, const CbLotEntry& b)
+{
+    return a.mOriginatingAccount == b.mOriginatingAccount && a.mOriginatingTag == b.mOriginatingTag &&
+           a.mCostBasis == b.mCostBasis && a.mAmount == b.mAmount;
+}
+
+template<typename Policy>
+void compareRandomRows(uint64_t seed, size_t numRows)
+{
+    constexpr AccountId NUM_ACCOUNTS = 5;
+
+    std::mt19937_64 rng(seed);
+    CbLotBook<Policy> book;
+    LotModel<Policy::CONSUMES_BACK> model(NUM_ACCOUNTS);
+
+    struct Pending
+    {
+        std::string mId;
+        AccountId mSource;
+        AccountId mDestination;
+        double mAmount;
+    };
+    std::vector<Pending> pending;
+
+    for (size_t row = 0; row < numRows; ++row)
+    {
+        const int64_t tag = static_cast<int64_t>(row);
+        const double price = 100.0 + static_cast<double>(rng() % 10000) / 100.0;
+        std::vector<CbLotEntry> realized;
+        std::vector<CbLotEntry> modelRealized;
+
+        const uint64_t kind = rng() % 10;
+        if (kind < 2 && !pending.empty())
+        {
+            // Deposits arrive in any order, into accounts with long or short positions
+            size_t i = rng() % pending.size();
+            Pending transfer = pending[i];
+            pending.erase(pending.begin() + static_cast<std::ptrdiff_t>(i));
+
+            book.finalizeTransfer(transfer.mDestination, transfer.mSource, std::string_view{transfer.mId}, transfer.mAmount, tag, realized);
+            model.finalizeTransfer(transfer.mDestination, transfer.mId, modelRealized);
+        }
+        else if (kind < 4)
+        {
+            // Withdrawals only from accounts without short lots, past the balance at the given price
+            AccountId source = static_cast<AccountId>(rng() % NUM_ACCOUNTS);
+            AccountId destination = static_cast<AccountId>((source + 1 + rng() % (NUM_ACCOUNTS - 1)) % NUM_ACCOUNTS);
+            if (!model.lots(source).empty() && model.lots(source).front().mAmount < 0.0)
+                continue;
+
+            double amount = static_cast<double>(rng() % 5000 + 1) / 1000.0;
+            std::string id = "tx" + std::to_string(row);
+            book.initiateTransfer(source, destination, std::string_view{id}, -amount, price, tag);
+            model.initiateTransfer(source, id, -amount, price, tag);
+            pending.push_back(Pending{id, source, destination, amount});
+        }
+        else
+        {
+            AccountId account = static_cast<AccountId>(rng() % NUM_ACCOUNTS);
+            double amount = static_cast<double>(rng() % 4000 + 1) / 1000.0;
+            if (rng() % 2 == 0)
+                amount = -amount;
+            book.realize(account, price, amount, tag, realized);
+            model.realize(account, price, amount, tag, modelRealized);
+        }
+
+        CHECK(realized.size() == modelRealized.size(), "seed %lu row %zu: %zu realized entries, expected %zu",
+              seed, row, realized.size(), modelRealized.size());
+        for (size_t i = 0; i < realized.size(); ++i)
+            CHECK(sameLot(realized[i], modelRealized[i]), "seed %lu row %zu: realized entry %zu differs", seed, row, i);
+
+        for (AccountId account = 0; account < NUM_ACCOUNTS; ++account)
+        {
+            std::vector<CbLotEntry> lots;
+            if (account < book.numAccounts())
+                book.accountLots(account).forEach([&lots](const CbLotEntry& lot) { lots.push_back(lot); });
+
+            const std::deque<CbLotEntry>& modelLots = model.lots(account);
+            CHECK(lots.size() == modelLots.size(), "seed %lu row %zu: account %u has %zu lots, expected %zu",
+                  seed, row, account, lots.size(), modelLots.size());
+            for (size_t i = 0; i < lots.size(); ++i)
+            {
+                CHECK(sameLot(lots[i], modelLots[i]), "seed %lu row %zu: account %u lot %zu is (%u, %ld, %g, %g), expected (%u, %ld, %g, %g)",
+                      seed, row, account, i,
+                      lots[i].mOriginatingAccount, lots[i].mOriginatingTag, lots[i].mCostBasis, lots[i].mAmount,
+                      modelLots[i].mOriginatingAccount, modelLots[i].mOriginatingTag, modelLots[i].mCostBasis, modelLots[i].mAmount);
+                CHECK(lots[i].mOriginatingAccount == account, "seed %lu row %zu: lot %zu of account %u belongs to account %u",
+                      seed, row, i, account, lots[i].mOriginatingAccount);
+            }
+        }
+    }
+}
+
+} // namespace {
+
+int main()
+{
+    for (uint64_t seed = 1; seed <= 50; ++seed)
+    {
+        compareRandomRows<CbFifoPolicy>(seed, 2000);
+        compareRandomRows<CbLifoPolicy>(seed, 2000);
+    }
+
+    if (gFailures != 0)
+    {
+        std::fprintf(stderr, "%d failures\n", gFailures);
+        return 1;
+    }
+    std::printf("lot book ok\n");
+    return 0;
+}
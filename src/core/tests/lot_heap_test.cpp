@@ -0,0 +1,298 @@
+// Randomized comparison of CbLotBook with the HIFO and LOFO policies, whose lots are kept in CbLotHeap, against
+// a model that finds the lot consumed first by a linear scan.
+//
+// Prices are drawn from a few values, so that many lots share a cost basis and are ordered by their tags.
+// A lot split by withdrawals can arrive at the destination in several lots of the same cost basis and tag, either of
+// them may be consumed first. Lots and realized entries are therefore compared per (account, tag, cost basis), with
+// amounts summed: consuming any of the equal lots leaves the same sums.
+
+#include "lot_book.h"
+#include "lot_policies.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+int gFailures = 0;
+
+#define CHECK(condition, ...)                                                \
+    do                                                                       \
+    {                                                                        \
+        if (!(condition))                                                    \
+        {                                                                    \
+            std::fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #condition); \
+            std::fprintf(stderr, __VA_ARGS__);                               \
+            std::fprintf(stderr, "\n");                                      \
+            ++gFailures;                                                     \
+            return;                                                          \
+        }                                                                    \
+    } while (false)
+
+struct ModelTransfer
+{
+    std::string mId;
+    std::vector<CbLotEntry> mEntries;
+};
+
+// Lots of every account in the order of acquisition, Before picks the lot consumed first
+template<typename Before>
+class OrderedLotModel
+{
+public:
+    using Lots = std::vector<CbLotEntry>;
+
+    explicit OrderedLotModel(size_t numAccounts)
+        : mAccounts(numAccounts)
+    {}
+
+    [[nodiscard]] const Lots& lots(AccountId account) const
+    {
+        return mAccounts[account];
+    }
+
+    void realize(AccountId account, double price, double amount, int64_t tag, std::vector<CbLotEntry>& realized)
+    {
+        Lots& lots = mAccounts[account];
+        if (std::abs(amount) < AMOUNT_EPSILON)
+            return;
+
+        double remaining = amount;
+        while (std::abs(remaining) >= AMOUNT_EPSILON && !lots.empty() && std::signbit(next(lots)->mAmount) != std::signbit(remaining))
+        {
+            Lots::iterator lot = next(lots);
+            if (std::signbit(lot->mAmount) == std::signbit(lot->mAmount + remaining))
+            {
+                realized.push_back(CbLotEntry{lot->mOriginatingAccount, lot->mOriginatingTag, lot->mCostBasis, -remaining});
+                lot->mAmount += remaining;
+                remaining = 0.0;
+                if (std::abs(lot->mAmount) < AMOUNT_EPSILON)
+                    lots.erase(lot);
+            }
+            else
+            {
+                realized.push_back(*lot);
+                remaining += lot->mAmount;
+                lots.erase(lot);
+            }
+        }
+
+        if (std::abs(remaining) >= AMOUNT_EPSILON)
+            lots.push_back(CbLotEntry{account, tag, price, remaining});
+    }
+
+    void initiateTransfer(AccountId account, const std::string& id, double amount, double price, int64_t tag)
+    {
+        Lots& lots = mAccounts[account];
+        ModelTransfer transfer{id, {}};
+
+        double remaining = -amount;
+        while (!lots.empty() && remaining >= AMOUNT_EPSILON)
+        {
+            Lots::iterator lot = next(lots);
+            if (remaining > lot->mAmount)
+            {
+                remaining -= lot->mAmount;
+                transfer.mEntries.push_back(*lot);
+                lots.erase(lot);
+            }
+            else
+            {
+                transfer.mEntries.push_back(CbLotEntry{lot->mOriginatingAccount, lot->mOriginatingTag, lot->mCostBasis, remaining});
+                lot->mAmount -= remaining;
+                remaining = 0.0;
+                if (lot->mAmount < AMOUNT_EPSILON)
+                    lots.erase(lot);
+            }
+        }
+
+        if (remaining >= TRANSFER_AMOUNT_EPSILON)
+        {
+            transfer.mEntries.push_back(CbLotEntry{account, tag, price, remaining});
+            lots.push_back(CbLotEntry{account, tag, price, -remaining});
+        }
+
+        mTransfers.push_back(std::move(transfer));
+    }
+
+    void finalizeTransfer(AccountId account, const std::string& id, std::vector<CbLotEntry>& realized)
+    {
+        for (auto it = mTransfers.begin(); it != mTransfers.end(); ++it)
+        {
+            if (it->mId != id)
+                continue;
+
+            for (const CbLotEntry& e : it->mEntries)
+                realize(account, e.mCostBasis, e.mAmount, e.mOriginatingTag, realized);
+            mTransfers.erase(it);
+            return;
+        }
+    }
+
+private:
+    std::vector<Lots> mAccounts;
+    std::vector<ModelTransfer> mTransfers;
+
+    [[nodiscard]] static Lots::iterator next(Lots& lots)
+    {
+        return std::min_element(lots.begin(), lots.end(), Before{});
+    }
+};
+
+[[nodiscard]] bool sameKey(const CbLotEntry& a, const CbLotEntry& b)
+{
+    return a.mOriginatingAccount == b.mOriginatingAccount && a.mOriginatingTag == b.mOriginatingTag && a.mCostBasis == b.mCostBasis;
+}
+
+// Adjacent entries of the same key merged into one with the sum of their amounts
+[[nodiscard]] std::vector<CbLotEntry> mergeEqualLots(const std::vector<CbLotEntry>& entries)
+{
+    std::vector<CbLotEntry> merged;
+    for (const CbLotEntry& e : entries)
+    {
+        if (!merged.empty() && sameKey(merged.back(), e))
+            merged.back().mAmount += e.mAmount;
+        else
+            merged.push_back(e);
+    }
+    return merged;
+}
+
+[[nodiscard]] bool sameLot(const CbLotEntry& a, const CbLotEntry& b)
+{
+    return sameKey(a, b) && std::abs(a.mAmount - b.mAmount) < 1e-9;
+}
+
+template<typename Policy, typename Before>
+void compareRandomRows(uint64_t seed, size_t numRows)
+{
+    constexpr AccountId NUM_ACCOUNTS = 5;
+
+    std::mt19937_64 rng(seed);
+    CbLotBook<Policy> book;
+    OrderedLotModel<Before> model(NUM_ACCOUNTS);
+
+    struct Pending
+    {
+        std::string mId;
+        AccountId mSource;
+        AccountId mDestination;
+        double mAmount;
+    };
+    std::vector<Pending> pending;
+
+    for (size_t row = 0; row < numRows; ++row)
+    {
+        const int64_t tag = static_cast<int64_t>(row);
+        const double price = 100.0 + static_cast<double>(rng() % 8);
+        std::vector<CbLotEntry> realized;
+        std::vector<CbLotEntry> modelRealized;
+
+        const uint64_t kind = rng() % 10;
+        if (kind < 2 && !pending.empty())
+        {
+            // Deposits arrive in any order, into accounts with long or short positions
+            size_t i = rng() % pending.size();
+            Pending transfer = pending[i];
+            pending.erase(pending.begin() + static_cast<std::ptrdiff_t>(i));
+
+            book.finalizeTransfer(transfer.mDestination, transfer.mSource, std::string_view{transfer.mId}, transfer.mAmount, tag, realized);
+            model.finalizeTransfer(transfer.mDestination, transfer.mId, modelRealized);
+        }
+        else if (kind < 4)
+        {
+            // Withdrawals only from accounts without short lots, past the balance at the given price
+            AccountId source = static_cast<AccountId>(rng() % NUM_ACCOUNTS);
+            AccountId destination = static_cast<AccountId>((source + 1 + rng() % (NUM_ACCOUNTS - 1)) % NUM_ACCOUNTS);
+            if (!model.lots(source).empty() && model.lots(source).front().mAmount < 0.0)
+                continue;
+
+            double amount = static_cast<double>(rng() % 5000 + 1) / 1000.0;
+            std::string id = "tx" + std::to_string(row);
+            book.initiateTransfer(source, destination, std::string_view{id}, -amount, price, tag);
+            model.initiateTransfer(source, id, -amount, price, tag);
+            pending.push_back(Pending{id, source, destination, amount});
+        }
+        else
+        {
+            AccountId account = static_cast<AccountId>(rng() % NUM_ACCOUNTS);
+            double amount = static_cast<double>(rng() % 4000 + 1) / 1000.0;
+            if (rng() % 2 == 0)
+                amount = -amount;
+            book.realize(account, price, amount, tag, realized);
+            model.realize(account, price, amount, tag, modelRealized);
+        }
+
+        // Equal lots are consumed one after another, their entries are adjacent
+        realized = mergeEqualLots(realized);
+        modelRealized = mergeEqualLots(modelRealized);
+        CHECK(realized.size() == modelRealized.size(), "seed %lu row %zu: %zu realized entries, expected %zu",
+              seed, row, realized.size(), modelRealized.size());
+        for (size_t i = 0; i < realized.size(); ++i)
+            CHECK(sameLot(realized[i], modelRealized[i]), "seed %lu row %zu: realized entry %zu is (%u, %ld, %g, %g), expected (%u, %ld, %g, %g)",
+                  seed, row, i,
+                  realized[i].mOriginatingAccount, realized[i].mOriginatingTag, realized[i].mCostBasis, realized[i].mAmount,
+                  modelRealized[i].mOriginatingAccount, modelRealized[i].mOriginatingTag, modelRealized[i].mCostBasis, modelRealized[i].mAmount);
+
+        for (AccountId account = 0; account < NUM_ACCOUNTS; ++account)
+        {
+            // Heap order is not the order of consumption, compare lots in the order of the policy
+            std::vector<CbLotEntry> lots;
+            if (account < book.numAccounts())
+                book.accountLots(account).forEach([&lots](const CbLotEntry& lot) { lots.push_back(lot); });
+            std::vector<CbLotEntry> modelLots = model.lots(account);
+            std::stable_sort(lots.begin(), lots.end(), Before{});
+            std::stable_sort(modelLots.begin(), modelLots.end(), Before{});
+
+            if (!lots.empty())
+            {
+                CHECK(Policy::next(book.accountLots(account)).mCostBasis == lots.front().mCostBasis &&
+                      Policy::next(book.accountLots(account)).mOriginatingTag == lots.front().mOriginatingTag,
+                      "seed %lu row %zu: account %u doesn't consume its first lot first", seed, row, account);
+            }
+
+            lots = mergeEqualLots(lots);
+            modelLots = mergeEqualLots(modelLots);
+            CHECK(lots.size() == modelLots.size(), "seed %lu row %zu: account %u has %zu distinct lots, expected %zu",
+                  seed, row, account, lots.size(), modelLots.size());
+            for (size_t i = 0; i < lots.size(); ++i)
+            {
+                CHECK(sameLot(lots[i], modelLots[i]), "seed %lu row %zu: account %u lot %zu is (%u, %ld, %g, %g), expected (%u, %ld, %g, %g)",
+                      seed, row, account, i,
+                      lots[i].mOriginatingAccount, lots[i].mOriginatingTag, lots[i].mCostBasis, lots[i].mAmount,
+                      modelLots[i].mOriginatingAccount, modelLots[i].mOriginatingTag, modelLots[i].mCostBasis, modelLots[i].mAmount);
+                CHECK(lots[i].mOriginatingAccount == account, "seed %lu row %zu: lot %zu of account %u belongs to account %u",
+                      seed, row, i, account, lots[i].mOriginatingAccount);
+            }
+
+            double modelBalance = 0.0;
+            for (const CbLotEntry& lot : model.lots(account))
+                modelBalance += lot.mAmount;
+            CHECK(std::abs(book.balance(account) - modelBalance) < 1e-6, "seed %lu row %zu: account %u has balance %g, expected %g",
+                  seed, row, account, book.balance(account), modelBalance);
+        }
+    }
+}
+
+} // namespace {
+
+int main()
+{
+    for (uint64_t seed = 1; seed <= 50; ++seed)
+    {
+        compareRandomRows<CbHifoPolicy, CbHifoOrder>(seed, 2000);
+        compareRandomRows<CbLofoPolicy, CbLofoOrder>(seed, 2000);
+    }
+
+    if (gFailures != 0)
+    {
+        std::fprintf(stderr, "%d failures\n", gFailures);
+        return 1;
+    }
+    std::printf("lot heap ok\n");
+    return 0;
+}
@@ -0,0 +1,332 @@
+// Randomized comparison of CbLotBook with the specific identification policy, whose lots are kept in
+// CbTaggedLotQueue, against a model that looks selected lots up by a linear scan.
+//
+// Rows select random open lots of the account, tags are listed twice and transfers split lots so that an account
+// holds several lots of one tag. Rows without a selection, and selections that run out, consume lots in the order of
+// acquisition. Selected lots far from the front leave tombstones behind, enough of them to compact the queues
+// many times over.
+
+#include "lot_book.h"
+#include "lot_policies.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+int gFailures = 0;
+
+#define CHECK(condition, ...)                                                \
+    do                                                                       \
+    {                                                                        \
+        if (!(condition))                                                    \
+        {                                                                    \
+            std::fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #condition); \
+            std::fprintf(stderr, __VA_ARGS__);                               \
+            std::fprintf(stderr, "\n");                                      \
+            ++gFailures;                                                     \
+            return;                                                          \
+        }                                                                    \
+    } while (false)
+
+struct ModelTransfer
+{
+    std::string mId;
+    std::vector<CbLotEntry> mEntries;
+};
+
+// Lots of every account in the order of acquisition, lots of the selected tags are consumed first
+class SpecIdModel
+{
+public:
+    using Lots = std::vector<CbLotEntry>;
+
+    explicit SpecIdModel(size_t numAccounts)
+        : mAccounts(numAccounts)
+    {}
+
+    [[nodiscard]] const Lots& lots(AccountId account) const
+    {
+        return mAccounts[account];
+    }
+
+    [[nodiscard]] bool disposes(AccountId account, double amount) const
+    {
+        const Lots& lots = mAccounts[account];
+        return !lots.empty() && std::signbit(lots.front().mAmount) != std::signbit(amount);
+    }
+
+    void select(std::vector<int64_t> tags)
+    {
+        mSelection = std::move(tags);
+        mSelectionCursor = 0;
+    }
+
+    void clearSelection()
+    {
+        mSelection.clear();
+        mSelectionCursor = 0;
+    }
+
+    void realize(AccountId account, double price, double amount, int64_t tag, std::vector<CbLotEntry>& realized)
+    {
+        Lots& lots = mAccounts[account];
+        if (std::abs(amount) < AMOUNT_EPSILON)
+            return;
+
+        double remaining = amount;
+        while (std::abs(remaining) >= AMOUNT_EPSILON && !lots.empty() && std::signbit(next(lots)->mAmount) != std::signbit(remaining))
+        {
+            Lots::iterator lot = next(lots);
+            if (std::signbit(lot->mAmount) == std::signbit(lot->mAmount + remaining))
+            {
+                realized.push_back(CbLotEntry{lot->mOriginatingAccount, lot->mOriginatingTag, lot->mCostBasis, -remaining});
+                lot->mAmount += remaining;
+                remaining = 0.0;
+                if (std::abs(lot->mAmount) < AMOUNT_EPSILON)
+                    lots.erase(lot);
+            }
+            else
+            {
+                realized.push_back(*lot);
+                remaining += lot->mAmount;
+                lots.erase(lot);
+            }
+        }
+
+        if (std::abs(remaining) >= AMOUNT_EPSILON)
+            lots.push_back(CbLotEntry{account, tag, price, remaining});
+    }
+
+    void initiateTransfer(AccountId account, const std::string& id, double amount, double price, int64_t tag)
+    {
+        Lots& lots = mAccounts[account];
+        ModelTransfer transfer{id, {}};
+
+        double remaining = -amount;
+        while (!lots.empty() && remaining >= AMOUNT_EPSILON)
+        {
+            Lots::iterator lot = next(lots);
+            if (remaining > lot->mAmount)
+            {
+                remaining -= lot->mAmount;
+                transfer.mEntries.push_back(*lot);
+                lots.erase(lot);
+            }
+            else
+            {
+                transfer.mEntries.push_back(CbLotEntry{lot->mOriginatingAccount, lot->mOriginatingTag, lot->mCostBasis, remaining});
+                lot->mAmount -= remaining;
+                remaining = 0.0;
+                if (lot->mAmount < AMOUNT_EPSILON)
+                    lots.erase(lot);
+            }
+        }
+
+        if (remaining >= TRANSFER_AMOUNT_EPSILON)
+        {
+            transfer.mEntries.push_back(CbLotEntry{account, tag, price, remaining});
+            lots.push_back(CbLotEntry{account, tag, price, -remaining});
+        }
+
+        mTransfers.push_back(std::move(transfer));
+    }
+
+    void finalizeTransfer(AccountId account, const std::string& id, std::vector<CbLotEntry>& realized)
+    {
+        for (auto it = mTransfers.begin(); it != mTransfers.end(); ++it)
+        {
+            if (it->mId != id)
+                continue;
+
+            for (const CbLotEntry& e : it->mEntries)
+                realize(account, e.mCostBasis, e.mAmount, e.mOriginatingTag, realized);
+            mTransfers.erase(it);
+            return;
+        }
+    }
+
+private:
+    std::vector<Lots> mAccounts;
+    std::vector<ModelTransfer> mTransfers;
+    std::vector<int64_t> mSelection;
+    size_t mSelectionCursor = 0;
+
+    // The oldest open lot of the current selected tag, the front lot once the selection is exhausted
+    [[nodiscard]] Lots::iterator next(Lots& lots)
+    {
+        for (; mSelectionCursor < mSelection.size(); ++mSelectionCursor)
+        {
+            auto lot = std::find_if(lots.begin(), lots.end(), [this](const CbLotEntry& l) {
+                return l.mOriginatingTag == mSelection[mSelectionCursor];
+            });
+            if (lot != lots.end())
+                return lot;
+        }
+        return lots.begin();
+    }
+};
+
+[[nodiscard]] bool sameLot(const CbLotEntry& a, const CbLotEntry& b)
+{
+    return a.mOriginatingAccount == b.mOriginatingAccount && a.mOriginatingTag == b.mOriginatingTag &&
+           a.mCostBasis == b.mCostBasis && a.mAmount == b.mAmount;
+}
+
+// Tags of random open lots of the account, some of them twice
+[[nodiscard]] std::vector<int64_t> randomSelection(std::mt19937_64& rng, const SpecIdModel::Lots& lots)
+{
+    std::vector<int64_t> tags;
+    if (lots.empty())
+        return tags;
+
+    size_t numTags = rng() % 5;
+    for (size_t i = 0; i < numTags; ++i)
+    {
+        tags.push_back(lots[rng() % lots.size()].mOriginatingTag);
+        if (rng() % 4 == 0)
+            tags.push_back(tags.back());
+    }
+    return tags;
+}
+
+void compareRandomRows(uint64_t seed, size_t numRows)
+{
+    constexpr AccountId NUM_ACCOUNTS = 3;
+
+    std::mt19937_64 rng(seed);
+    CbLotBook<CbSpecIdPolicy> book;
+    SpecIdModel model(NUM_ACCOUNTS);
+
+    struct Pending
+    {
+        std::string mId;
+        AccountId mSource;
+        AccountId mDestination;
+        double mAmount;
+    };
+    std::vector<Pending> pending;
+
+    // Rows select lots only when they dispose of lots of the account, as the transition function does
+    auto selectRandomLots = [&](AccountId account, double amount, int64_t tag, size_t row) {
+        bool disposes = book.disposes(account, amount);
+        CHECK(disposes == model.disposes(account, amount), "seed %lu row %zu: account %u disposes %d", seed, row, account, disposes);
+        if (!disposes || rng() % 4 == 0)
+            return;
+
+        std::vector<int64_t> tags = randomSelection(rng, model.lots(account));
+        book.selectLots(account, tags, tag);
+        model.select(std::move(tags));
+    };
+
+    for (size_t row = 0; row < numRows; ++row)
+    {
+        const int64_t tag = static_cast<int64_t>(row);
+        const double price = 100.0 + static_cast<double>(rng() % 10000) / 100.0;
+        std::vector<CbLotEntry> realized;
+        std::vector<CbLotEntry> modelRealized;
+
+        const uint64_t kind = rng() % 20;
+        if (kind < 3 && !pending.empty())
+        {
+            // Deposits arrive in any order, into accounts with long or short positions
+            size_t i = rng() % pending.size();
+            Pending transfer = pending[i];
+            pending.erase(pending.begin() + static_cast<std::ptrdiff_t>(i));
+
+            book.finalizeTransfer(transfer.mDestination, transfer.mSource, std::string_view{transfer.mId}, transfer.mAmount, tag, realized);
+            model.finalizeTransfer(transfer.mDestination, transfer.mId, modelRealized);
+        }
+        else if (kind < 6)
+        {
+            // Withdrawals only from accounts without short lots, past the balance at the given price
+            AccountId source = static_cast<AccountId>(rng() % NUM_ACCOUNTS);
+            AccountId destination = static_cast<AccountId>((source + 1 + rng() % (NUM_ACCOUNTS - 1)) % NUM_ACCOUNTS);
+            if (!model.lots(source).empty() && model.lots(source).front().mAmount < 0.0)
+                continue;
+
+            double amount = static_cast<double>(rng() % 5000 + 1) / 1000.0;
+            std::string id = "tx" + std::to_string(row);
+            selectRandomLots(source, -amount, tag, row);
+            book.initiateTransfer(source, destination, std::string_view{id}, -amount, price, tag);
+            model.initiateTransfer(source, id, -amount, price, tag);
+            pending.push_back(Pending{id, source, destination, amount});
+        }
+        else if (kind < 7)
+        {
+            // A tag without an open lot fails before the row changes anything
+            AccountId account = static_cast<AccountId>(rng() % NUM_ACCOUNTS);
+            const int64_t missing[] = {-1};
+            bool failed = false;
+            try
+            {
+                book.selectLots(account, missing, tag);
+            }
+            catch (const CbEngineError& e)
+            {
+                failed = e.error().mKind == CbErrorKind::LotsNotOpen;
+            }
+            CHECK(failed, "seed %lu row %zu: selection of a lot that is not open didn't fail", seed, row);
+        }
+        else
+        {
+            // Buys outnumber sells, so that accounts hold many lots to select from
+            AccountId account = static_cast<AccountId>(rng() % NUM_ACCOUNTS);
+            double amount = static_cast<double>(rng() % 4000 + 1) / 1000.0;
+            if (rng() % 5 < 2)
+                amount = -amount;
+            selectRandomLots(account, amount, tag, row);
+            book.realize(account, price, amount, tag, realized);
+            model.realize(account, price, amount, tag, modelRealized);
+        }
+
+        book.clearSelection();
+        model.clearSelection();
+
+        CHECK(realized.size() == modelRealized.size(), "seed %lu row %zu: %zu realized entries, expected %zu",
+              seed, row, realized.size(), modelRealized.size());
+        for (size_t i = 0; i < realized.size(); ++i)
+            CHECK(sameLot(realized[i], modelRealized[i]), "seed %lu row %zu: realized entry %zu is (%u, %ld, %g, %g), expected (%u, %ld, %g, %g)",
+                  seed, row, i,
+                  realized[i].mOriginatingAccount, realized[i].mOriginatingTag, realized[i].mCostBasis, realized[i].mAmount,
+                  modelRealized[i].mOriginatingAccount, modelRealized[i].mOriginatingTag, modelRealized[i].mCostBasis, modelRealized[i].mAmount);
+
+        for (AccountId account = 0; account < NUM_ACCOUNTS; ++account)
+        {
+            std::vector<CbLotEntry> lots;
+            if (account < book.numAccounts())
+                book.accountLots(account).forEach([&lots](const CbLotEntry& lot) { lots.push_back(lot); });
+
+            const SpecIdModel::Lots& modelLots = model.lots(account);
+            CHECK(lots.size() == modelLots.size(), "seed %lu row %zu: account %u has %zu lots, expected %zu",
+                  seed, row, account, lots.size(), modelLots.size());
+            for (size_t i = 0; i < lots.size(); ++i)
+            {
+                CHECK(sameLot(lots[i], modelLots[i]), "seed %lu row %zu: account %u lot %zu is (%u, %ld, %g, %g), expected (%u, %ld, %g, %g)",
+                      seed, row, account, i,
+                      lots[i].mOriginatingAccount, lots[i].mOriginatingTag, lots[i].mCostBasis, lots[i].mAmount,
+                      modelLots[i].mOriginatingAccount, modelLots[i].mOriginatingTag, modelLots[i].mCostBasis, modelLots[i].mAmount);
+            }
+        }
+    }
+}
+
+} // namespace {
+
+int main()
+{
+    for (uint64_t seed = 1; seed <= 50; ++seed)
+        compareRandomRows(seed, 3000);
+
+    if (gFailures != 0)
+    {
+        std::fprintf(stderr, "%d failures\n", gFailures);
+        return 1;
+    }
+    std::printf("tagged lot queue ok\n");
+    return 0;
+}
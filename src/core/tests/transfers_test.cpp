@@ -0,0 +1,126 @@
+// Randomized comparison of CbPendingTransfers against a linear scan of pending transfers in initiation order.
+//
+// Transfers are drawn from a few ids and triplets, so many pending transfers share one index key and are
+// matched and erased in any order.
+
+#include "transfers.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+int gFailures = 0;
+
+#define CHECK(condition, ...)                                                \
+    do                                                                       \
+    {                                                                        \
+        if (!(condition))                                                    \
+        {                                                                    \
+            std::fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #condition); \
+            std::fprintf(stderr, __VA_ARGS__);                               \
+            std::fprintf(stderr, "\n");                                      \
+            ++gFailures;                                                     \
+            return;                                                          \
+        }                                                                    \
+    } while (false)
+
+using Transfers = CbPendingTransfers<int64_t>;
+using Transfer = Transfers::Transfer;
+
+struct ModelTransfer
+{
+    std::optional<std::string> mTransferId;
+    AccountId mSourceAccount;
+    AccountId mDestinationAccount;
+    double mAmount;
+    int64_t mTag;
+};
+
+[[nodiscard]] bool modelMatches(const ModelTransfer& t, std::optional<std::string_view> transferId, AccountId sourceAccount, AccountId destinationAccount, double amount)
+{
+    if (t.mTransferId.has_value() && transferId.has_value())
+        return *t.mTransferId == *transferId;
+    if (t.mTransferId.has_value() != transferId.has_value())
+        return false;
+    return t.mSourceAccount == sourceAccount && t.mDestinationAccount == destinationAccount && std::abs(t.mAmount - amount) < TRANSFER_AMOUNT_EPSILON;
+}
+
+void compareRandomTransfers(uint64_t seed, size_t numOperations)
+{
+    std::mt19937_64 rng(seed);
+    Transfers transfers;
+    std::vector<ModelTransfer> model;
+
+    auto randomRecord = [&rng]() {
+        ModelTransfer t{std::nullopt, static_cast<AccountId>(rng() % 2), static_cast<AccountId>(2 + rng() % 2),
+                        1.0 + static_cast<double>(rng() % 3) * 1e-8, 0};
+        if (rng() % 3 == 0)
+            t.mTransferId = "id" + std::to_string(rng() % 3);
+        return t;
+    };
+
+    for (size_t op = 0; op < numOperations; ++op)
+    {
+        ModelTransfer record = randomRecord();
+        std::optional<std::string_view> id;
+        if (record.mTransferId.has_value())
+            id = *record.mTransferId;
+
+        // Push more than match, so that long slot lists build up
+        if (rng() % 5 < 3)
+        {
+            record.mTag = static_cast<int64_t>(op);
+            Transfer transfer = transfers.newTransfer(id, record.mSourceAccount, record.mDestinationAccount, record.mAmount);
+            transfer.mEntries.push_back(record.mTag);
+            transfers.push(std::move(transfer));
+            model.push_back(record);
+            continue;
+        }
+
+        uint32_t slot = transfers.find(id, record.mSourceAccount, record.mDestinationAccount, record.mAmount);
+        auto it = std::find_if(model.begin(), model.end(), [&](const ModelTransfer& t) {
+            return modelMatches(t, id, record.mSourceAccount, record.mDestinationAccount, record.mAmount);
+        });
+
+        if (it == model.end())
+        {
+            CHECK(slot == Transfers::npos, "seed %lu operation %zu: found a transfer, expected none", seed, op);
+            continue;
+        }
+
+        CHECK(slot != Transfers::npos, "seed %lu operation %zu: found no transfer, expected %ld", seed, op, it->mTag);
+        CHECK(transfers[slot].mEntries.front() == it->mTag, "seed %lu operation %zu: found %ld, expected %ld",
+              seed, op, transfers[slot].mEntries.front(), it->mTag);
+        transfers.erase(slot);
+        model.erase(it);
+        CHECK(transfers.size() == model.size(), "seed %lu operation %zu: %zu pending, expected %zu", seed, op, transfers.size(), model.size());
+    }
+
+    std::vector<int64_t> pending;
+    transfers.forEach([&pending](const Transfer& t) { pending.push_back(t.mEntries.front()); });
+    CHECK(pending.size() == model.size(), "seed %lu: %zu pending at the end, expected %zu", seed, pending.size(), model.size());
+    for (size_t i = 0; i < pending.size(); ++i)
+        CHECK(pending[i] == model[i].mTag, "seed %lu: pending transfer %zu is %ld, expected %ld", seed, i, pending[i], model[i].mTag);
+}
+
+} // namespace {
+
+int main()
+{
+    for (uint64_t seed = 1; seed <= 50; ++seed)
+        compareRandomTransfers(seed, 5000);
+
+    if (gFailures != 0)
+    {
+        std::fprintf(stderr, "%d failures\n", gFailures);
+        return 1;
+    }
+    std::printf("pending transfers ok\n");
+    return 0;
+}
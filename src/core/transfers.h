@@ -0,0 +1,298 @@
+#pragma once
+
+#include "core.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+
+template<typename AccountEntry, typename Allocator = std::allocator<char>>
+struct CbTransfer
+{
+    using String = CbBasicString<Allocator>;
+    using Entries = CbVector<AccountEntry, Allocator>;
+
+    // Some transfers can provide unique transfer id, in this case it's a preferred way to match outgoing and incoming records
+    std::optional<String> mTransferId;
+
+    // For the rest, we rely on triplet (source, dest, amount)
+    AccountId mSourceAccount;
+    AccountId mDestinationAccount;
+    double mAmount;
+
+    Entries mEntries;
+
+    // Check if incoming record (transferId, source, destination, amount) finalizes this transfer
+    [[nodiscard]] bool matches(std::optional<std::string_view> transferId, AccountId sourceAccount, AccountId destinationAccount, double amount) const
+    {
+        if (mTransferId.has_value() && transferId.has_value())
+            return std::string_view{*mTransferId} == *transferId;
+
+        // if mTransferId is defined for either in or out record then it should be defined for both records
+        if (mTransferId.has_value() != transferId.has_value())
+            return false;
+
+        return mSourceAccount == sourceAccount && mDestinationAccount == destinationAccount && std::abs(mAmount - amount) < TRANSFER_AMOUNT_EPSILON;
+    }
+};
+
+// Pending transfers (withdrawals that wait for a matching deposit).
+// Matching an incoming record and removing the matched transfer are O(1) on average.
+//
+// There are two indexes:
+// * transfers with transfer id are indexed by the hash of the id
+// * the rest are indexed by the hash of triplet (source, destination, amount bucket)
+// Buckets are 2 * TRANSFER_AMOUNT_EPSILON wide, amounts closer than TRANSFER_AMOUNT_EPSILON always fall into
+// the same or adjacent buckets, so lookup checks 3 buckets.
+//
+// Index keys are just hashes, candidates are verified with CbTransfer::matches.
+// When several pending transfers match, the oldest one wins, exactly as with a linear scan in initiation order.
+// Erased transfers stay in their slot lists until the list is compacted, so many pending transfers under one key
+// (e.g. equal transfers between the same accounts) don't make erase linear in their number.
+template<typename AccountEntry, typename Allocator = std::allocator<char>>
+class CbPendingTransfers
+{
+public:
+    using Transfer = CbTransfer<AccountEntry, Allocator>;
+
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    explicit CbPendingTransfers(const Allocator& allocator = Allocator())
+        : mAllocator(allocator)
+        , mSlots(allocator)
+        , mFreeSlots(allocator)
+        , mById(0, KeyHash{}, std::equal_to<std::size_t>{}, allocator)
+        , mByTriplet(0, KeyHash{}, std::equal_to<std::size_t>{}, allocator)
+    {}
+
+    [[nodiscard]] size_t size() const noexcept
+    {
+        return mSize;
+    }
+
+    [[nodiscard]] Transfer& operator[](uint32_t slot) noexcept
+    {
+        return mSlots[slot].mTransfer;
+    }
+
+    // Transfer that isn't pending yet, its containers use the allocator of the pending transfers
+    [[nodiscard]] Transfer newTransfer(std::optional<std::string_view> transferId, AccountId sourceAccount, AccountId destinationAccount, double amount) const
+    {
+        std::optional<typename Transfer::String> id;
+        if (transferId.has_value())
+            id.emplace(*transferId, mAllocator);
+        return Transfer{std::move(id), sourceAccount, destinationAccount, amount, typename Transfer::Entries(mAllocator)};
+    }
+
+    void push(Transfer&& transfer)
+    {
+        uint32_t slot;
+        if (mFreeSlots.empty())
+        {
+            slot = static_cast<uint32_t>(mSlots.size());
+            mSlots.push_back(Slot{newTransfer(std::nullopt, 0, 0, 0.0)});
+        }
+        else
+        {
+            slot = mFreeSlots.back();
+            mFreeSlots.pop_back();
+        }
+
+        Slot& s = mSlots[slot];
+        s.mTransfer = std::move(transfer);
+        s.mSeqNo = mNextSeqNo++;
+        s.mUsed = true;
+
+        // Slot lists are kept in initiation order
+        SlotRef ref{slot, s.mSeqNo};
+        if (s.mTransfer.mTransferId.has_value())
+            slotList(mById, idKey(*s.mTransfer.mTransferId)).mRefs.push_back(ref);
+        else
+            slotList(mByTriplet, tripletKey(s.mTransfer.mSourceAccount, s.mTransfer.mDestinationAccount, amountBucket(s.mTransfer.mAmount))).mRefs.push_back(ref);
+
+        ++mSize;
+    }
+
+    // Find the oldest pending transfer finalized by the incoming record, returns npos if there is none
+    [[nodiscard]] uint32_t find(std::optional<std::string_view> transferId, AccountId sourceAccount, AccountId destinationAccount, double amount) const
+    {
+        if (transferId.has_value())
+            return findIn(mById, idKey(*transferId), npos, transferId, sourceAccount, destinationAccount, amount);
+
+        uint32_t found = npos;
+        double bucket = amountBucket(amount);
+        for (double b : {bucket - 1.0, bucket, bucket + 1.0})
+            found = findIn(mByTriplet, tripletKey(sourceAccount, destinationAccount, b), found, transferId, sourceAccount, destinationAccount, amount);
+
+        return found;
+    }
+
+    void erase(uint32_t slot)
+    {
+        Slot& s = mSlots[slot];
+        s.mUsed = false;
+
+        if (s.mTransfer.mTransferId.has_value())
+            unlink(mById, idKey(*s.mTransfer.mTransferId));
+        else
+            unlink(mByTriplet, tripletKey(s.mTransfer.mSourceAccount, s.mTransfer.mDestinationAccount, amountBucket(s.mTransfer.mAmount)));
+
+        // Release transferred entries right away, the slot itself is reused by the next transfer
+        s.mTransfer = newTransfer(std::nullopt, 0, 0, 0.0);
+        mFreeSlots.push_back(slot);
+        --mSize;
+    }
+
+    // Visit pending transfers in initiation order
+    template<typename Func>
+    void forEach(Func&& func) const
+    {
+        CbVector<const Slot*, Allocator> used(mAllocator);
+        used.reserve(mSize);
+        for (const Slot& s : mSlots)
+        {
+            if (s.mUsed)
+                used.push_back(&s);
+        }
+
+        std::sort(used.begin(), used.end(), [](const Slot* a, const Slot* b) { return a->mSeqNo < b->mSeqNo; });
+
+        for (const Slot* s : used)
+            func(s->mTransfer);
+    }
+
+private:
+    struct Slot
+    {
+        Transfer mTransfer;
+        uint64_t mSeqNo = 0;
+        bool mUsed = false;
+    };
+
+    // Keys are already hashes
+    struct KeyHash
+    {
+        [[nodiscard]] std::size_t operator()(std::size_t key) const noexcept
+        {
+            return key;
+        }
+    };
+
+    // Slots are reused, the sequence number tells whether the slot still holds the transfer that was pushed
+    struct SlotRef
+    {
+        uint32_t mSlot;
+        uint64_t mSeqNo;
+    };
+
+    struct SlotList
+    {
+        explicit SlotList(const Allocator& allocator)
+            : mRefs(allocator)
+        {}
+
+        CbVector<SlotRef, Allocator> mRefs;
+        // Refs before mHead are all erased
+        size_t mHead = 0;
+        // Erased refs from mHead on
+        size_t mErased = 0;
+    };
+
+    using Index = std::unordered_map<std::size_t, SlotList, KeyHash, std::equal_to<std::size_t>,
+                                     CbRebind<Allocator, std::pair<const std::size_t, SlotList>>>;
+
+    Allocator mAllocator;
+    CbVector<Slot, Allocator> mSlots;
+    CbVector<uint32_t, Allocator> mFreeSlots;
+    Index mById;
+    Index mByTriplet;
+    uint64_t mNextSeqNo = 0;
+    size_t mSize = 0;
+
+    [[nodiscard]] SlotList& slotList(Index& index, std::size_t key)
+    {
+        return index.try_emplace(key, SlotList(mAllocator)).first->second;
+    }
+
+    [[nodiscard]] static double amountBucket(double amount) noexcept
+    {
+        // + 0.0 turns -0.0 into 0.0, otherwise they would hash differently
+        return std::floor(amount / (2 * TRANSFER_AMOUNT_EPSILON)) + 0.0;
+    }
+
+    [[nodiscard]] static std::size_t hashCombine(std::size_t seed, std::size_t h) noexcept
+    {
+        return seed ^ (h + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+    }
+
+    [[nodiscard]] static std::size_t idKey(std::string_view transferId) noexcept
+    {
+        return std::hash<std::string_view>{}(transferId);
+    }
+
+    [[nodiscard]] static std::size_t tripletKey(AccountId sourceAccount, AccountId destinationAccount, double bucket) noexcept
+    {
+        std::size_t key = (static_cast<std::size_t>(sourceAccount) << 32) | destinationAccount;
+        return hashCombine(std::hash<std::size_t>{}(key), std::hash<double>{}(bucket));
+    }
+
+    // Return the oldest of found and the first matching transfer in the list under key
+    [[nodiscard]] uint32_t findIn(const Index& index, std::size_t key, uint32_t found,
+                                  std::optional<std::string_view> transferId, AccountId sourceAccount, AccountId destinationAccount, double amount) const
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+            return found;
+
+        const SlotList& list = it->second;
+        for (size_t i = list.mHead; i < list.mRefs.size(); ++i)
+        {
+            const SlotRef& ref = list.mRefs[i];
+            if (!isLinked(ref))
+                continue;
+
+            if (mSlots[ref.mSlot].mTransfer.matches(transferId, sourceAccount, destinationAccount, amount))
+            {
+                if (found == npos || ref.mSeqNo < mSlots[found].mSeqNo)
+                    found = ref.mSlot;
+                break;
+            }
+        }
+
+        return found;
+    }
+
+    [[nodiscard]] bool isLinked(const SlotRef& ref) const noexcept
+    {
+        const Slot& s = mSlots[ref.mSlot];
+        return s.mUsed && s.mSeqNo == ref.mSeqNo;
+    }
+
+    // Account for a transfer erased from the list under key, amortized O(1).
+    // Matched transfers are usually the oldest ones, they are skipped by moving the head,
+    // the list is compacted once erased refs make up half of it.
+    void unlink(Index& index, std::size_t key)
+    {
+        auto it = index.find(key);
+        SlotList& list = it->second;
+        ++list.mErased;
+
+        while (list.mHead < list.mRefs.size() && !isLinked(list.mRefs[list.mHead]))
+        {
+            ++list.mHead;
+            --list.mErased;
+        }
+
+        if (list.mHead + list.mErased == list.mRefs.size())
+        {
+            index.erase(it);
+        }
+        else if (2 * (list.mHead + list.mErased) > list.mRefs.size())
+        {
+            std::erase_if(list.mRefs, [this](const SlotRef& ref) { return !isLinked(ref); });
+            list.mHead = 0;
+            list.mErased = 0;
+        }
+    }
+};
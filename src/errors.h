@@ -0,0 +1,59 @@
+#pragma once
+
+#include "accounts.h"
+#include "core/core.h"
+
+// Error policy of the core engines inside the extension: errors of the engines are reported with ereport,
+// accounts are named by the dictionary of the state
+struct CbPgErrors
+{
+    const CbAccountDictionary* mAccounts;
+
+    [[noreturn]] void fail(const CbError& error) const
+    {
+        switch (error.mKind)
+        {
+        case CbErrorKind::LotsNotOpen:
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("tag %ld: some of the selected lots are not open on \"%s\"",
+                            error.mTag, mAccounts->name(error.mAccount))));
+            break;
+        case CbErrorKind::TransferFromNegativeBalance:
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("tag %ld: attempt to transfer from account \"%s\" that has negative balance records",
+                            error.mTag, mAccounts->name(error.mAccount))));
+            break;
+        case CbErrorKind::NotEnoughBalance:
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("tag %ld: not enough balance on \"%s\", %g left untransfered",
+                            error.mTag, mAccounts->name(error.mAccount), error.mAmount)));
+            break;
+        case CbErrorKind::NotEnoughBalanceWhenNegative:
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("tag %ld: not enough balance on \"%s\", %g left untransfered, price must be specifiied in order to go negative on transfers",
+                            error.mTag, mAccounts->name(error.mAccount), error.mAmount)));
+            break;
+        case CbErrorKind::UnmatchedTransfer:
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("tag %ld: can't finalize transfer %s -> %s %g, unable to match with initiating record",
+                            error.mTag, mAccounts->name(error.mOtherAccount), mAccounts->name(error.mAccount), error.mAmount)));
+            break;
+        case CbErrorKind::TransferAmountMismatch:
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("tag %ld: can't finalize transfer, in/out amounts mismatch: %g, %g",
+                            error.mTag, error.mOtherAmount, error.mAmount)));
+            break;
+        }
+
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("tag %ld: cost basis engine error %u", error.mTag, static_cast<unsigned>(error.mKind))));
+        pg_unreachable();
+    }
+};
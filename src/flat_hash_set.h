@@ -0,0 +1,111 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+// Open addressing hash set that assigns dense indexes 0..size()-1 to keys in insertion order.
+//
+// Keys are stored once, contiguously, in insertion order. Slots are 8 bytes: 32 bits of the hash and the key index.
+// Linear probing compares hashes first and touches the key only when they match.
+// Lookup is heterogeneous: find/insert accept anything Hash and KeyEqual accept, e.g. std::string_view for PgString
+// keys, so looking up an existing key doesn't allocate. Keys are never erased.
+template<typename Key, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<>>
+class PgFlatHashSet
+{
+public:
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    [[nodiscard]] size_t size() const noexcept
+    {
+        return mKeys.size();
+    }
+
+    [[nodiscard]] size_t capacity() const noexcept
+    {
+        return mSlots.size();
+    }
+
+    [[nodiscard]] const Key& key(uint32_t index) const noexcept
+    {
+        return mKeys[index];
+    }
+
+    // Returns the index of the key or npos
+    template<typename K>
+    [[nodiscard]] uint32_t find(const K& key) const
+    {
+        if (mSlots.empty())
+            return npos;
+
+        uint32_t h = hash(key);
+        for (size_t pos = h & mMask; ; pos = (pos + 1) & mMask)
+        {
+            const Slot& slot = mSlots[pos];
+            if (slot.mIndex == npos)
+                return npos;
+            if (slot.mHash == h && KeyEqual{}(mKeys[slot.mIndex], key))
+                return slot.mIndex;
+        }
+    }
+
+    // Returns the index of the key, inserts it if it's not there yet
+    template<typename K>
+    [[nodiscard]] uint32_t insert(const K& key)
+    {
+        uint32_t index = find(key);
+        if (index != npos) [[likely]]
+            return index;
+
+        // Keep load factor below 3/4
+        if ((mKeys.size() + 1) * 4 > mSlots.size() * 3)
+            grow();
+
+        index = static_cast<uint32_t>(mKeys.size());
+        mKeys.emplace_back(key);
+        place(Slot{hash(key), index});
+        return index;
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t mHash;
+        uint32_t mIndex;
+    };
+
+    PgVector<Key> mKeys;
+    PgVector<Slot> mSlots;
+    size_t mMask = 0;
+
+    // Fibonacci hashing spreads the bits of weak hashes (std::hash of integers is identity)
+    template<typename K>
+    [[nodiscard]] static uint32_t hash(const K& key)
+    {
+        return static_cast<uint32_t>((static_cast<uint64_t>(Hash{}(key)) * 0x9e3779b97f4a7c15ULL) >> 32);
+    }
+
+    void place(Slot slot) noexcept
+    {
+        size_t pos = slot.mHash & mMask;
+        while (mSlots[pos].mIndex != npos)
+            pos = (pos + 1) & mMask;
+        mSlots[pos] = slot;
+    }
+
+    void grow()
+    {
+        PgVector<Slot> oldSlots(std::max<size_t>(16, mSlots.size() * 2), Slot{0, npos});
+        mSlots.swap(oldSlots);
+        mMask = mSlots.size() - 1;
+
+        // Hashes are kept in slots, keys are not rehashed
+        for (const Slot& slot : oldSlots)
+        {
+            if (slot.mIndex != npos)
+                place(slot);
+        }
+    }
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "lot_state.h"
+#include "core/lot_policies.h"
+
+// States of the lot based methods, see CbLotState. Matching policies are a part of the core engines.
+
+using CbFifoState = CbLotState<CbFifoPolicy>;
+
+// IMPORTANT: If this fails, change the expected size and adjust(!!!) pg_cost_basis--*.sql
+static_assert(sizeof(CbFifoState) == 24);
+
+using CbLifoState = CbLotState<CbLifoPolicy>;
+
+// IMPORTANT: If this fails, change the expected size and adjust(!!!) lot_method.sql.in
+static_assert(sizeof(CbLifoState) == 24);
+
+using CbHifoState = CbLotState<CbHifoPolicy>;
+
+// IMPORTANT: If this fails, change the expected size and adjust(!!!) lot_method.sql.in
+static_assert(sizeof(CbHifoState) == 24);
+
+using CbLofoState = CbLotState<CbLofoPolicy>;
+
+// IMPORTANT: If this fails, change the expected size and adjust(!!!) lot_method.sql.in
+static_assert(sizeof(CbLofoState) == 24);
+
+using CbSpecIdState = CbLotState<CbSpecIdPolicy>;
+
+// IMPORTANT: If this fails, change the expected size and adjust(!!!) lot_method.sql.in
+static_assert(sizeof(CbSpecIdState) == 24);
@@ -0,0 +1,738 @@
+#pragma once
+
+#include "common.h"
+#include "sfunc.h"
+#include "accounts.h"
+#include "errors.h"
+#include "transfers.h"
+#include "snapshot.h"
+#include "core/lot_book.h"
+
+#include <numeric>
+#include <span>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+extern "C"
+{
+#include <catalog/pg_type_d.h>
+#include <funcapi.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/jsonb.h>
+#include <utils/tuplestore.h>
+}
+
+inline char jsTagKey[] = "t";
+inline char jsAmountKey[] = "a";
+inline char jsPlKey[] = "pl";
+inline char jsCostBasisKey[] = "cb";
+
+// Size of a lot in snapshots
+inline constexpr size_t SNAPSHOT_LOT_SIZE = sizeof(uint32_t) + sizeof(int64_t) + 2 * sizeof(double);
+
+inline void writeLot(StringInfo buf, const CbLotEntry& lot)
+{
+    pq_sendint32(buf, lot.mOriginatingAccount);
+    pq_sendint64(buf, lot.mOriginatingTag);
+    pq_sendfloat8(buf, lot.mCostBasis);
+    pq_sendfloat8(buf, lot.mAmount);
+}
+
+[[nodiscard]] inline CbLotEntry readLot(StringInfo buf)
+{
+    CbLotEntry lot;
+    lot.mOriginatingAccount = pq_getmsgint(buf, 4);
+    lot.mOriginatingTag = pq_getmsgint64(buf);
+    lot.mCostBasis = pq_getmsgfloat8(buf);
+    lot.mAmount = pq_getmsgfloat8(buf);
+    return lot;
+}
+
+// State of the lot based aggregates (FIFO, LIFO, HIFO, LOFO, specific identification).
+//
+// Lots are matched by CbLotBook of the core engines, see core/lot_book.h for the policies. The state adds what
+// the aggregates need on top of it: memory contexts, the account dictionary, realized entries of the rows,
+// snapshots and conversion of the outputs to SQL values.
+template<typename Policy>
+class CbLotState
+{
+    using Book = CbLotBook<Policy, PgContextAllocator<char>, CbPgErrors>;
+    using LotStore = typename Book::LotStore;
+
+    // Append-only, rows refer to their realized entries by (offset, length)
+    using RealizedLog = PgVector<CbLotEntry>;
+
+    struct SharedState
+    {
+        SharedState(MemoryContext memoryContext, CbAccountDictionary* sharedAccounts)
+            : mMemoryContext(memoryContext)
+            , mLotsContext(AllocSetContextCreate(memoryContext, "pg_cost_basis lots", ALLOCSET_START_SMALL_SIZES))
+            , mAccounts(sharedAccounts != nullptr ? sharedAccounts : &mOwnAccounts)
+            , mBook(PgContextAllocator<char>(memoryContext), PgContextAllocator<char>(mLotsContext), CbPgErrors{mAccounts})
+        {}
+
+        // Owns all the memory of the shared state
+        MemoryContext mMemoryContext;
+        // Lot stores grow by doubling, buffers released by one store are reused by the others from allocset freelists
+        MemoryContext mLotsContext;
+        // Empty when the dictionary is shared
+        CbAccountDictionary mOwnAccounts;
+        // mOwnAccounts or the dictionary of cb_multi, see beginRow
+        CbAccountDictionary* mAccounts;
+        // Lots of every account and pending transfers
+        Book mBook;
+        // Realized entries of all rows.
+        // Rows emitted by the executor are bitwise copies of the state and may still refer to entries of previous rows,
+        // so the log is only appended to, unless no row but the current one can see it.
+        RealizedLog mRealizedLog;
+        // Sum of capital gains of all rows since the shared state was created, not a part of snapshots
+        double mTotalGain = 0.0;
+        // Runtime statistics since the shared state was created, not a part of snapshots, see statsToRecord
+        uint64_t mRows = 0;
+        size_t mPeakOpenLots = 0;
+        size_t mPeakPendingTransfers = 0;
+        // Validation when the aggregate is done, see CbAggregateEnd
+        typename CbAggregateEnd<SharedState>::Link mAggregateEnd;
+
+        // Accounts, lots of every account in the order of forEach, pending transfers
+        void writeBook(StringInfo buf) const
+        {
+            mAccounts->write(buf);
+
+            pq_sendint32(buf, static_cast<uint32_t>(mBook.numAccounts()));
+            for (AccountId account = 0; account < mBook.numAccounts(); ++account)
+            {
+                const LotStore& lots = mBook.accountLots(account);
+                pq_sendint32(buf, static_cast<uint32_t>(lots.size()));
+                lots.forEach([buf](const CbLotEntry& lot) { writeLot(buf, lot); });
+            }
+
+            writeTransfers(buf, mBook.transfers(), writeLot);
+        }
+
+        void readBook(StringInfo buf)
+        {
+            // Containers allocate from the current memory context
+            MemoryContext oldContext = MemoryContextSwitchTo(mMemoryContext);
+
+            mAccounts->read(buf);
+
+            uint32_t numAccounts = readCount(buf, sizeof(uint32_t));
+            for (AccountId account = 0; account < numAccounts; ++account)
+            {
+                // Accounts without lots keep their stores, the snapshot of the restored book is the same
+                (void)mBook.accountLots(account);
+                for (uint32_t n = readCount(buf, SNAPSHOT_LOT_SIZE); n > 0; --n)
+                    mBook.pushLot(account, checkedLot(readLot(buf)));
+            }
+
+            readTransfers(buf, mBook.transfers(), [this](StringInfo entryBuf) { return checkedLot(readLot(entryBuf)); });
+            mBook.transfers().forEach([this](const auto& transfer) {
+                checkAccount(transfer.mSourceAccount);
+                checkAccount(transfer.mDestinationAccount);
+            });
+
+            MemoryContextSwitchTo(oldContext);
+        }
+
+        // Account ids of a snapshot are used as indexes, make sure a corrupted one can't point outside
+        void checkAccount(AccountId account) const
+        {
+            if (account >= mAccounts->size()) [[unlikely]]
+            {
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                         errmsg("invalid cost basis snapshot: unknown account id %u", account)));
+            }
+        }
+
+        [[nodiscard]] const CbLotEntry& checkedLot(const CbLotEntry& lot) const
+        {
+            checkAccount(lot.mOriginatingAccount);
+            return lot;
+        }
+
+        // Unfinished transfers are warnings, remaining amounts are for information
+        void validateAtEnd() const
+        {
+            const CbAccountDictionary& accounts = *mAccounts;
+
+            mBook.transfers().forEach([&accounts](const auto& transfer) {
+                ereport(WARNING,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("unfinished transfer detected %s -> %s: %g, withdrawal without deposit",
+                                accounts.name(transfer.mSourceAccount), accounts.name(transfer.mDestinationAccount), transfer.mAmount)));
+            });
+
+            for (AccountId account = 0; account < mBook.numAccounts(); ++account)
+            {
+                mBook.accountLots(account).forEach([&accounts](const CbLotEntry& entry) {
+                    if (std::abs(entry.mAmount) >= AMOUNT_EPSILON)
+                    {
+                        ereport(INFO,
+                                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                                 errmsg("remaining amount detected %s %g, not all amount was realized at end",
+                                        accounts.name(entry.mOriginatingAccount), entry.mAmount)));
+                    }
+                });
+            }
+        }
+    };
+
+    // Allocated lazily, shared between calls, see newSharedState for its lifetime
+    // Contains lot stores for each account and pending asset transfers
+    SharedState* mSharedState = nullptr;
+    // Slice of the realized log with last realized records. Capital gains are calculated against mLastPrice
+    uint32_t mRealizedOffset = 0;
+    uint32_t mRealizedLength = 0;
+    // Last realized price
+    double mLastPrice = 1.0;
+
+public:
+    [[nodiscard]] static CbLotState* newState()
+    {
+        return new (palloc(sizeof(CbLotState))) CbLotState{};
+    }
+
+    void writeSnapshot(StringInfo buf) const
+    {
+        writeSnapshotHeader(buf, Policy::METHOD);
+
+        pq_sendbyte(buf, mSharedState != nullptr);
+        if (mSharedState != nullptr)
+            mSharedState->writeBook(buf);
+
+        pq_sendfloat8(buf, mLastPrice);
+        std::span<const CbLotEntry> lastRealized = this->lastRealized();
+        pq_sendint32(buf, static_cast<uint32_t>(lastRealized.size()));
+        for (const CbLotEntry& entry : lastRealized)
+            writeLot(buf, entry);
+    }
+
+    [[nodiscard]] MemoryContext memoryContext() const noexcept
+    {
+        return mSharedState->mMemoryContext;
+    }
+
+    [[nodiscard]] bool hasSharedState() const noexcept
+    {
+        return mSharedState != nullptr;
+    }
+
+    [[nodiscard]] CbAccountDictionary& accounts() noexcept
+    {
+        return *mSharedState->mAccounts;
+    }
+
+    // Prepare the state to process the next row in place. keepRealized is set when emitted states of previous rows
+    // may still be read, i.e. by window functions that emit their state. A new shared state is validated when
+    // aggContext is reset, callers that validate it themselves pass null. cb_multi passes its dictionary in
+    // sharedAccounts, the engine names its accounts by it instead of a dictionary of its own.
+    void beginRow(MemoryContext sharedParent, MemoryContext aggContext, bool resetSharedState, bool keepRealized, const bytea* snapshot,
+                  CbAccountDictionary* sharedAccounts = nullptr)
+    {
+        if (mSharedState != nullptr && resetSharedState)
+            validateAtEnd();
+
+        // The previous shared state may still be referenced by emitted states, it is released with its parent
+        if (mSharedState == nullptr || resetSharedState)
+        {
+            mSharedState = newSharedState<SharedState>(sharedParent, sharedAccounts);
+            if (aggContext != nullptr)
+                CbAggregateEnd<SharedState>::registerFor(aggContext, mSharedState);
+
+            // Only the book of the snapshot is restored, the row part belongs to the row that was snapshotted
+            if (snapshot != nullptr)
+            {
+                StringInfoData buf = snapshotReader(snapshot);
+                readSnapshotHeader(&buf, Policy::METHOD);
+                if (pq_getmsgbyte(&buf) != 0)
+                    mSharedState->readBook(&buf);
+            }
+        }
+
+        // Only window functions emit a state per row, a plain aggregate emits the final state only,
+        // realized entries of previous rows are not visible to anyone else. Window functions keep all of them.
+        RealizedLog& log = mSharedState->mRealizedLog;
+        if (!keepRealized)
+            log.clear();
+
+        if (log.size() > std::numeric_limits<uint32_t>::max()) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                     errmsg("too many realized entries in one partition")));
+        }
+
+        mRealizedOffset = static_cast<uint32_t>(log.size());
+        mRealizedLength = 0;
+        mLastPrice = 1.0;
+    }
+
+    // Publish the realized entries appended by the row
+    void endRow() noexcept
+    {
+        mRealizedLength = static_cast<uint32_t>(mSharedState->mRealizedLog.size() - mRealizedOffset);
+        mSharedState->mTotalGain += capitalGain();
+        mSharedState->mBook.clearSelection();
+
+        ++mSharedState->mRows;
+        mSharedState->mPeakOpenLots = std::max(mSharedState->mPeakOpenLots, mSharedState->mBook.totals().mLots);
+        mSharedState->mPeakPendingTransfers = std::max(mSharedState->mPeakPendingTransfers, mSharedState->mBook.transfers().size());
+    }
+
+    // Whether the row disposes of lots of the account, see CbLotBook::disposes
+    [[nodiscard]] bool disposes(AccountId account, double amount) const noexcept
+    {
+        return mSharedState->mBook.disposes(account, amount);
+    }
+
+    // Lots that the current row consumes first, only for lot stores that support selection.
+    // The selection is dropped by endRow.
+    void selectLots(AccountId account, std::span<const int64_t> lotTags, int64_t tag)
+    {
+        mSharedState->mBook.selectLots(account, lotTags, tag);
+    }
+
+    void initiateTransfer(
+            AccountId account, AccountId destinationAccount, std::optional<std::string_view> txId,
+            double amount, std::optional<double> price,
+            int64_t tag)
+    {
+        mSharedState->mBook.initiateTransfer(account, destinationAccount, txId, amount, price, tag);
+    }
+
+    void finalizeTransfer(AccountId account, AccountId sourceAccount, std::optional<std::string_view> transferId, double amount, int64_t tag)
+    {
+        mSharedState->mBook.finalizeTransfer(account, sourceAccount, transferId, amount, tag, mSharedState->mRealizedLog);
+    }
+
+    void realize(AccountId account, double price, double amount, int64_t tag)
+    {
+        mLastPrice = price;
+        mSharedState->mBook.realize(account, price, amount, tag, mSharedState->mRealizedLog);
+    }
+
+    [[nodiscard]] size_t numAccounts() const noexcept
+    {
+        return mSharedState->mAccounts->size();
+    }
+
+    // Summary accessors read the shared state, that is the totals after the last processed row.
+    // They are O(1) and return zeros for the initial state.
+
+    [[nodiscard]] size_t totalEntries() const noexcept
+    {
+        return mSharedState != nullptr ? mSharedState->mBook.totals().mLots : 0;
+    }
+
+    [[nodiscard]] double totalBalance() const noexcept
+    {
+        return mSharedState != nullptr ? mSharedState->mBook.totals().mAmount : 0.0;
+    }
+
+    // Sum of amount * cost basis over all open lots
+    [[nodiscard]] double totalCost() const noexcept
+    {
+        return mSharedState != nullptr ? mSharedState->mBook.totals().mCost : 0.0;
+    }
+
+    // Sum of capital gains of all processed rows, the result of total gain aggregates
+    [[nodiscard]] double totalGain() const noexcept
+    {
+        return mSharedState != nullptr ? mSharedState->mTotalGain : 0.0;
+    }
+
+    template<typename AccountArg>
+    [[nodiscard]] double accountBalance(FunctionCallInfo fcinfo, int argno) const
+    {
+        if (mSharedState == nullptr)
+            return 0.0;
+
+        return balanceOf(findAccountArg<AccountArg>(fcinfo, argno, *mSharedState->mAccounts));
+    }
+
+    // Balance of (asset, account) position of portfolio aggregates
+    template<typename AccountArg>
+    [[nodiscard]] double positionBalance(FunctionCallInfo fcinfo, int assetArgno, int accountArgno) const
+    {
+        if (mSharedState == nullptr)
+            return 0.0;
+
+        return balanceOf(findPositionArg<AccountArg>(fcinfo, assetArgno, accountArgno, *mSharedState->mAccounts));
+    }
+
+    [[nodiscard]] double capitalGain() const noexcept
+    {
+        std::span<const CbLotEntry> lastRealized = this->lastRealized();
+        return std::accumulate(lastRealized.begin(), lastRealized.end(), 0.0, [this](double total, auto& entry) {
+            return total + entry.mAmount * (mLastPrice - entry.mCostBasis);
+        });
+    }
+
+    [[nodiscard]] char* toPstring() const
+    {
+        // Initial state, no rows processed yet
+        if (mSharedState == nullptr)
+            return psprintf("(g:0,c:0,b:0,rlen:0)");
+
+        return psprintf("(g:%lu,c:%lu,b:%g,rlen:%zu)", numAccounts(), totalEntries(), totalBalance(), static_cast<size_t>(mRealizedLength));
+    }
+
+    [[nodiscard]] ArrayType* lastRealizedTags() const
+    {
+        CbPhaseTimer timer(CbPhase::Accessors);
+
+        return lastRealizedArray(INT8OID, [](const CbLotEntry& e) { return Int64GetDatum(e.mOriginatingTag); });
+    }
+
+    // Set returning function result: a (tag, amount, cost_basis, pl) row per last realized entry
+    void lastRealizedToTuplestore(FunctionCallInfo fcinfo) const
+    {
+        CbPhaseTimer timer(CbPhase::Accessors);
+
+        InitMaterializedSRF(fcinfo, 0);
+        ReturnSetInfo* rsinfo = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+
+        for (const CbLotEntry& entry : lastRealized())
+        {
+            Datum values[4] = {
+                Int64GetDatum(entry.mOriginatingTag),
+                Float8GetDatum(entry.mAmount),
+                Float8GetDatum(entry.mCostBasis),
+                Float8GetDatum(entry.mAmount * (mLastPrice - entry.mCostBasis)),
+            };
+            bool nulls[4] = {false, false, false, false};
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+    }
+
+    // Record of parallel arrays (tags, amounts, cost_bases, pls) of the last realized entries
+    [[nodiscard]] Datum lastRealizedToArrays(FunctionCallInfo fcinfo) const
+    {
+        CbPhaseTimer timer(CbPhase::Accessors);
+
+        TupleDesc tupleDesc;
+        if (get_call_result_type(fcinfo, nullptr, &tupleDesc) != TYPEFUNC_COMPOSITE) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("function returning record called in context that cannot accept type record")));
+        }
+
+        Datum values[4] = {
+            PointerGetDatum(lastRealizedArray(INT8OID, [](const CbLotEntry& e) { return Int64GetDatum(e.mOriginatingTag); })),
+            PointerGetDatum(lastRealizedArray(FLOAT8OID, [](const CbLotEntry& e) { return Float8GetDatum(e.mAmount); })),
+            PointerGetDatum(lastRealizedArray(FLOAT8OID, [](const CbLotEntry& e) { return Float8GetDatum(e.mCostBasis); })),
+            PointerGetDatum(lastRealizedArray(FLOAT8OID, [this](const CbLotEntry& e) { return Float8GetDatum(e.mAmount * (mLastPrice - e.mCostBasis)); })),
+        };
+        bool nulls[4] = {false, false, false, false};
+        return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupleDesc), values, nulls));
+    }
+
+    // Record of parallel arrays (accounts, tags, amounts, cost_bases) of all open lots, the result of holdings
+    // aggregates. Lots are listed by account in the order of first appearance, then in the order of the lot store.
+    [[nodiscard]] Datum openLotsToArrays(FunctionCallInfo fcinfo) const
+    {
+        CbPhaseTimer timer(CbPhase::Accessors);
+
+        TupleDesc tupleDesc;
+        if (get_call_result_type(fcinfo, nullptr, &tupleDesc) != TYPEFUNC_COMPOSITE) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("function returning record called in context that cannot accept type record")));
+        }
+
+        size_t numLots = 0;
+        if (mSharedState != nullptr)
+        {
+            for (AccountId account = 0; account < mSharedState->mBook.numAccounts(); ++account)
+                numLots += mSharedState->mBook.accountLots(account).size();
+        }
+
+        Datum* elems = static_cast<Datum*>(palloc(std::max<size_t>(numLots, 1) * 4 * sizeof(Datum)));
+        Datum* accounts = elems;
+        Datum* tags = elems + numLots;
+        Datum* amounts = elems + 2 * numLots;
+        Datum* costBases = elems + 3 * numLots;
+
+        size_t n = 0;
+        if (mSharedState != nullptr)
+        {
+            for (AccountId account = 0; account < mSharedState->mBook.numAccounts(); ++account)
+            {
+                const LotStore& lots = mSharedState->mBook.accountLots(account);
+                if (lots.empty())
+                    continue;
+
+                Datum name = CStringGetTextDatum(mSharedState->mAccounts->name(account));
+                lots.forEach([&](const CbLotEntry& lot) {
+                    accounts[n] = name;
+                    tags[n] = Int64GetDatum(lot.mOriginatingTag);
+                    amounts[n] = Float8GetDatum(lot.mAmount);
+                    costBases[n] = Float8GetDatum(lot.mCostBasis);
+                    ++n;
+                });
+            }
+        }
+
+        Datum values[4] = {
+            PointerGetDatum(n != 0 ? construct_array_builtin(accounts, static_cast<int>(n), TEXTOID) : construct_empty_array(TEXTOID)),
+            PointerGetDatum(n != 0 ? construct_array_builtin(tags, static_cast<int>(n), INT8OID) : construct_empty_array(INT8OID)),
+            PointerGetDatum(n != 0 ? construct_array_builtin(amounts, static_cast<int>(n), FLOAT8OID) : construct_empty_array(FLOAT8OID)),
+            PointerGetDatum(n != 0 ? construct_array_builtin(costBases, static_cast<int>(n), FLOAT8OID) : construct_empty_array(FLOAT8OID)),
+        };
+        bool nulls[4] = {false, false, false, false};
+        return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupleDesc), values, nulls));
+    }
+
+    // Record (rows, accounts, open_lots, peak_open_lots, pending_transfers, peak_pending_transfers, lots_split,
+    // accounts_load_factor, memory_bytes) of the shared state. Counters are maintained per row, memory is summed
+    // over the blocks of the shared state's memory contexts.
+    [[nodiscard]] Datum statsToRecord(FunctionCallInfo fcinfo) const
+    {
+        CbPhaseTimer timer(CbPhase::Accessors);
+
+        TupleDesc tupleDesc;
+        if (get_call_result_type(fcinfo, nullptr, &tupleDesc) != TYPEFUNC_COMPOSITE) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("function returning record called in context that cannot accept type record")));
+        }
+
+        Datum values[9] = {Int64GetDatum(0), Int64GetDatum(0), Int64GetDatum(0), Int64GetDatum(0), Int64GetDatum(0),
+                           Int64GetDatum(0), Int64GetDatum(0), Float8GetDatum(0.0), Int64GetDatum(0)};
+        if (mSharedState != nullptr)
+        {
+            const Book& book = mSharedState->mBook;
+            values[0] = Int64GetDatum(static_cast<int64_t>(mSharedState->mRows));
+            values[1] = Int64GetDatum(static_cast<int64_t>(mSharedState->mAccounts->size()));
+            values[2] = Int64GetDatum(static_cast<int64_t>(book.totals().mLots));
+            values[3] = Int64GetDatum(static_cast<int64_t>(mSharedState->mPeakOpenLots));
+            values[4] = Int64GetDatum(static_cast<int64_t>(book.transfers().size()));
+            values[5] = Int64GetDatum(static_cast<int64_t>(mSharedState->mPeakPendingTransfers));
+            values[6] = Int64GetDatum(static_cast<int64_t>(book.lotsSplit()));
+            values[7] = Float8GetDatum(mSharedState->mAccounts->loadFactor());
+            values[8] = Int64GetDatum(static_cast<int64_t>(MemoryContextMemAllocated(mSharedState->mMemoryContext, true)));
+        }
+        bool nulls[9] = {false, false, false, false, false, false, false, false, false};
+        return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupleDesc), values, nulls));
+    }
+
+    [[nodiscard]] JsonbValue* lastRealizedToJsonb() const
+    {
+        CbPhaseTimer timer(CbPhase::Accessors);
+
+        JsonbParseState* parseState = nullptr;
+
+        pushJsonbValue(&parseState, WJB_BEGIN_ARRAY, NULL);
+
+        for (auto& entry : lastRealized())
+        {
+            pushJsonbValue(&parseState, WJB_BEGIN_OBJECT, NULL);
+            {
+                JsonbValue key;
+                key.type = jbvString;
+                key.val.string.len = sizeof(jsTagKey) - 1;
+                key.val.string.val = jsTagKey;
+                pushJsonbValue(&parseState, WJB_KEY, &key);
+
+                JsonbValue val;
+                val.type = jbvNumeric;
+                val.val.numeric = int64_to_numeric(entry.mOriginatingTag);
+                pushJsonbValue(&parseState, WJB_VALUE, &val);
+            }
+
+            {
+                JsonbValue key;
+                key.type = jbvString;
+                key.val.string.len = sizeof(jsAmountKey) - 1;
+                key.val.string.val = jsAmountKey;
+                pushJsonbValue(&parseState, WJB_KEY, &key);
+
+                JsonbValue val;
+                val.type = jbvNumeric;
+                val.val.numeric = int64_div_fast_to_numeric(static_cast<int64_t>(entry.mAmount*1e8), 8);
+                pushJsonbValue(&parseState, WJB_VALUE, &val);
+            }
+
+            {
+                JsonbValue key;
+                key.type = jbvString;
+                key.val.string.len = sizeof(jsPlKey) - 1;
+                key.val.string.val = jsPlKey;
+                pushJsonbValue(&parseState, WJB_KEY, &key);
+
+                double pl = entry.mAmount * (mLastPrice - entry.mCostBasis);
+                JsonbValue val;
+                val.type = jbvNumeric;
+                val.val.numeric = int64_div_fast_to_numeric(static_cast<int64_t>(pl*1e8), 8);
+                pushJsonbValue(&parseState, WJB_VALUE, &val);
+            }
+
+            {
+                JsonbValue key;
+                key.type = jbvString;
+                key.val.string.len = sizeof(jsCostBasisKey) - 1;
+                key.val.string.val = jsCostBasisKey;
+                pushJsonbValue(&parseState, WJB_KEY, &key);
+
+                JsonbValue val;
+                val.type = jbvNumeric;
+                val.val.numeric = int64_div_fast_to_numeric(static_cast<int64_t>(entry.mCostBasis*1e8), 8);
+                pushJsonbValue(&parseState, WJB_VALUE, &val);
+            }
+
+            pushJsonbValue(&parseState, WJB_END_OBJECT, NULL);
+        }
+
+        return pushJsonbValue(&parseState, WJB_END_ARRAY, NULL);
+    }
+
+    // Reports unfinished transfers and remaining amounts, the aggregate end callback doesn't repeat it
+    void validateAtEnd() const
+    {
+        CbAggregateEnd<SharedState>::unregister(mSharedState);
+        mSharedState->validateAtEnd();
+    }
+
+private:
+    [[nodiscard]] double balanceOf(AccountId account) const noexcept
+    {
+        if (account == CbAccountDictionary::npos)
+            return 0.0;
+
+        return mSharedState->mBook.balance(account);
+    }
+
+    [[nodiscard]] std::span<const CbLotEntry> lastRealized() const noexcept
+    {
+        if (mRealizedLength == 0)
+            return {};
+        return std::span<const CbLotEntry>{mSharedState->mRealizedLog.data() + mRealizedOffset, mRealizedLength};
+    }
+
+    // Array of one field of the last realized entries. Elements are collected on the heap, a single row can
+    // realize any number of lots.
+    template<typename ToDatum>
+    [[nodiscard]] ArrayType* lastRealizedArray(Oid elementType, ToDatum&& toDatum) const
+    {
+        std::span<const CbLotEntry> lastRealized = this->lastRealized();
+        if (lastRealized.empty())
+            return construct_empty_array(elementType);
+
+        Datum* elems = static_cast<Datum*>(palloc(lastRealized.size() * sizeof(Datum)));
+        std::transform(lastRealized.begin(), lastRealized.end(), elems, toDatum);
+        ArrayType* result = construct_array_builtin(elems, static_cast<int>(lastRealized.size()), elementType);
+        pfree(elems);
+        return result;
+    }
+};
+
+// Functions of a lot based method, see lot_method.sql.in for their SQL declarations. Method is the name of
+// the method in the C symbols, e.g. Lifo for CbLifoState and CbLifo_sfunc. LotSelection is passed to commonSFunc,
+// the 7th argument of the sfuncs is then lot_tags instead of prev_tag. Expand it inside extern "C".
+#define CB_LOT_METHOD_FUNCTIONS(Method, LotSelection)                                                       \
+    PG_FUNCTION_INFO_V1(Cb##Method##State_in);                                                              \
+    Datum Cb##Method##State_in(PG_FUNCTION_ARGS)                                                            \
+    {                                                                                                       \
+        Cb##Method##State* state = Cb##Method##State::newState();                                           \
+        PG_RETURN_POINTER(state);                                                                           \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##State_out);                                                             \
+    Datum Cb##Method##State_out(PG_FUNCTION_ARGS)                                                           \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        PG_RETURN_CSTRING(state->toPstring());                                                              \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_snapshot);                                                             \
+    Datum Cb##Method##_snapshot(PG_FUNCTION_ARGS)                                                           \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        StringInfoData buf;                                                                                 \
+        pq_begintypsend(&buf);                                                                              \
+        state->writeSnapshot(&buf);                                                                         \
+        PG_RETURN_BYTEA_P(pq_endtypsend(&buf));                                                             \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_capital_gain);                                                         \
+    Datum Cb##Method##_capital_gain(PG_FUNCTION_ARGS)                                                       \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        PG_RETURN_FLOAT8(state->capitalGain());                                                             \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_realized_tags);                                                        \
+    Datum Cb##Method##_realized_tags(PG_FUNCTION_ARGS)                                                      \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        PG_RETURN_ARRAYTYPE_P(state->lastRealizedTags());                                                   \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_realized_entries);                                                     \
+    Datum Cb##Method##_realized_entries(PG_FUNCTION_ARGS)                                                   \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        PG_RETURN_POINTER(JsonbValueToJsonb(state->lastRealizedToJsonb()));                                 \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_realized);                                                             \
+    Datum Cb##Method##_realized(PG_FUNCTION_ARGS)                                                           \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        state->lastRealizedToTuplestore(fcinfo);                                                            \
+        return (Datum) 0;                                                                                   \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_realized_arrays);                                                      \
+    Datum Cb##Method##_realized_arrays(PG_FUNCTION_ARGS)                                                    \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        PG_RETURN_DATUM(state->lastRealizedToArrays(fcinfo));                                              \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_balance);                                                              \
+    Datum Cb##Method##_balance(PG_FUNCTION_ARGS)                                                            \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        PG_RETURN_FLOAT8(state->totalBalance());                                                            \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_open_lots);                                                            \
+    Datum Cb##Method##_open_lots(PG_FUNCTION_ARGS)                                                          \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        PG_RETURN_INT64(static_cast<int64_t>(state->totalEntries()));                                       \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_open_cost);                                                            \
+    Datum Cb##Method##_open_cost(PG_FUNCTION_ARGS)                                                          \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        PG_RETURN_FLOAT8(state->totalCost());                                                               \
+    }                                                                                                       \
+                                                                                                            \
+    CB_LOT_METHOD_ACCOUNT_FUNCTIONS(Method, LotSelection, , text*)                                          \
+    CB_LOT_METHOD_ACCOUNT_FUNCTIONS(Method, LotSelection, _int4, int32_t)                                   \
+    CB_LOT_METHOD_ACCOUNT_FUNCTIONS(Method, LotSelection, _int8, int64_t)
+
+// Functions of CB_LOT_METHOD_FUNCTIONS that take an account, Suffix tells the account type in the C symbols
+#define CB_LOT_METHOD_ACCOUNT_FUNCTIONS(Method, LotSelection, Suffix, AccountArg)                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_account_balance##Suffix);                                              \
+    Datum Cb##Method##_account_balance##Suffix(PG_FUNCTION_ARGS)                                            \
+    {                                                                                                       \
+        Cb##Method##State* state = reinterpret_cast<Cb##Method##State*>(PG_GETARG_POINTER(0));              \
+        PG_RETURN_FLOAT8(state->accountBalance<AccountArg>(fcinfo, 1));                            \
+    }                                                                                                       \
+                                                                                                            \
+    PG_FUNCTION_INFO_V1(Cb##Method##_sfunc##Suffix);                                                        \
+    Datum Cb##Method##_sfunc##Suffix(PG_FUNCTION_ARGS)                                                      \
+    {                                                                                                       \
+        return commonSFunc<Cb##Method##State, AccountArg, false, false, LotSelection>(fcinfo);              \
+    }
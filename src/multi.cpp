@@ -0,0 +1,291 @@
+#include "core/acb0.h"
+#include "acb_state.h"
+#include "lot_policies.h"
+#include "sfunc.h"
+
+extern "C"
+{
+#include <lib/stringinfo.h>
+}
+
+namespace {
+
+// Methods of cb_multi are a bitmask, bit n selects the method with CbMethod n, bit 0 selects ACB0:
+// acb0 = 1, acb = 2, fifo = 4, lifo = 8, hifo = 16, lofo = 32
+constexpr uint32_t ACB0_METHOD_BIT = 1;
+
+[[nodiscard]] constexpr uint32_t methodBit(CbMethod method) noexcept
+{
+    return 1u << static_cast<uint8_t>(method);
+}
+
+constexpr uint32_t MULTI_METHODS = ACB0_METHOD_BIT | methodBit(CbMethod::Acb) | methodBit(CbMethod::Fifo) |
+                                   methodBit(CbMethod::Lifo) | methodBit(CbMethod::Hifo) | methodBit(CbMethod::Lofo);
+
+// Several cost basis methods fed from one scan.
+//
+// Arguments are parsed and the account is looked up once per row, then the row goes to the engine of every selected
+// method. Engines are the states of the single method aggregates, embedded by value, so a row of cb_multi carries
+// the row of every engine and accessors return them as states of their own types. Engines name accounts by the
+// dictionary of cb_multi, their shared states only refer to it.
+class CbMultiState
+{
+    struct SharedState
+    {
+        explicit SharedState(MemoryContext memoryContext)
+            : mMemoryContext(memoryContext)
+        {}
+
+        // Owns the memory of the shared account lookup, engines have shared states of their own with the same parent
+        MemoryContext mMemoryContext;
+        CbAccountDictionary mAccounts;
+    };
+
+    // Allocated lazily, shared between calls, see newSharedState for its lifetime
+    SharedState* mSharedState = nullptr;
+    // Selected methods, fixed by the first row
+    uint32_t mMethods = 0;
+
+public:
+    CbAcb0State mAcb0{ACB0_INITIAL_COST_BASIS, ACB0_INITIAL_COST_BASIS, ACB0_INITIAL_BALANCE, ACB0_INITIAL_BALANCE, 0.0};
+    CbAcbState mAcb;
+    CbFifoState mFifo;
+    CbLifoState mLifo;
+    CbHifoState mHifo;
+    CbLofoState mLofo;
+
+    [[nodiscard]] static CbMultiState* newState()
+    {
+        return new (palloc(sizeof(CbMultiState))) CbMultiState{};
+    }
+
+    [[nodiscard]] bool hasMethod(uint32_t bit) const noexcept
+    {
+        return (mMethods & bit) != 0;
+    }
+
+    [[nodiscard]] MemoryContext memoryContext() const noexcept
+    {
+        return mSharedState->mMemoryContext;
+    }
+
+    [[nodiscard]] bool hasSharedState() const noexcept
+    {
+        return mSharedState != nullptr;
+    }
+
+    [[nodiscard]] CbAccountDictionary& accounts() noexcept
+    {
+        return mSharedState->mAccounts;
+    }
+
+    void selectMethods(uint32_t methods, int64_t tag)
+    {
+        if (methods == 0 || (methods & ~MULTI_METHODS) != 0) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("tag %ld: invalid methods %u, expected a combination of acb0 = 1, acb = 2, fifo = 4, lifo = 8, hifo = 16, lofo = 32",
+                            tag, methods)));
+        }
+
+        if (mSharedState != nullptr && methods != mMethods) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("tag %ld: methods can't change within an aggregate, %u was %u", tag, methods, mMethods)));
+        }
+
+        mMethods = methods;
+    }
+
+    void beginRow(MemoryContext sharedParent, MemoryContext aggContext, [[maybe_unused]] bool resetSharedState, bool keepRealized, [[maybe_unused]] const bytea* snapshot)
+    {
+        if (mSharedState == nullptr)
+            mSharedState = newSharedState<SharedState>(sharedParent);
+
+        // A row that doesn't trade leaves ACB0 as it was, e.g. a transfer
+        if (hasMethod(ACB0_METHOD_BIT))
+            mAcb0 = acb0Step(mAcb0.mCostBasisAfter, mAcb0.mBalanceAfter, 0.0, 0.0);
+
+        // Every engine sees the same rows, the first one reports unfinished transfers and remaining amounts
+        forEachEngine([this, sharedParent, &aggContext, keepRealized](auto& engine) {
+            engine.beginRow(sharedParent, aggContext, false, keepRealized, nullptr, &mSharedState->mAccounts);
+            aggContext = nullptr;
+        });
+    }
+
+    void endRow() noexcept
+    {
+        forEachEngine([](auto& engine) { engine.endRow(); });
+    }
+
+    void realize(AccountId account, double price, double amount, int64_t tag)
+    {
+        if (hasMethod(ACB0_METHOD_BIT))
+            mAcb0 = acb0Step(mAcb0.mCostBasisAfter, mAcb0.mBalanceAfter, price, amount);
+
+        forEachEngine([&](auto& engine) {
+            withEngine(engine, [&] { engine.realize(account, price, amount, tag); });
+        });
+    }
+
+    void initiateTransfer(
+            AccountId account, AccountId destinationAccount, std::optional<std::string_view> txId,
+            double amount, std::optional<double> price,
+            int64_t tag)
+    {
+        forEachEngine([&](auto& engine) {
+            withEngine(engine, [&] { engine.initiateTransfer(account, destinationAccount, txId, amount, price, tag); });
+        });
+    }
+
+    void finalizeTransfer(AccountId account, AccountId sourceAccount, std::optional<std::string_view> transferId, double amount, int64_t tag)
+    {
+        forEachEngine([&](auto& engine) {
+            withEngine(engine, [&] { engine.finalizeTransfer(account, sourceAccount, transferId, amount, tag); });
+        });
+    }
+
+    [[nodiscard]] char* toPstring() const
+    {
+        StringInfoData buf;
+        initStringInfo(&buf);
+        appendStringInfo(&buf, "(methods:%u", mMethods);
+        if (hasMethod(ACB0_METHOD_BIT))
+        {
+            appendStringInfo(&buf, ",acb0:(%g,%g,%g,%g,%g)", mAcb0.mCostBasisBefore, mAcb0.mCostBasisAfter,
+                             mAcb0.mBalanceBefore, mAcb0.mBalanceAfter, mAcb0.mCapitalGain);
+        }
+        if (hasMethod(methodBit(CbMethod::Acb)))
+        {
+            appendStringInfo(&buf, ",acb:(%g,%g,%g,%g,%g)", mAcb.mCostBasisBefore, mAcb.mCostBasisAfter,
+                             mAcb.mBalanceBefore, mAcb.mBalanceAfter, mAcb.mCapitalGain);
+        }
+        if (hasMethod(methodBit(CbMethod::Fifo)))
+            appendStringInfo(&buf, ",fifo:%s", mFifo.toPstring());
+        if (hasMethod(methodBit(CbMethod::Lifo)))
+            appendStringInfo(&buf, ",lifo:%s", mLifo.toPstring());
+        if (hasMethod(methodBit(CbMethod::Hifo)))
+            appendStringInfo(&buf, ",hifo:%s", mHifo.toPstring());
+        if (hasMethod(methodBit(CbMethod::Lofo)))
+            appendStringInfo(&buf, ",lofo:%s", mLofo.toPstring());
+        appendStringInfoChar(&buf, ')');
+        return buf.data;
+    }
+
+private:
+    // Visit the selected engines, ACB0 has no engine state and is updated by the callers
+    template<typename Func>
+    void forEachEngine(Func&& func)
+    {
+        if (hasMethod(methodBit(CbMethod::Acb)))
+            func(mAcb);
+        if (hasMethod(methodBit(CbMethod::Fifo)))
+            func(mFifo);
+        if (hasMethod(methodBit(CbMethod::Lifo)))
+            func(mLifo);
+        if (hasMethod(methodBit(CbMethod::Hifo)))
+            func(mHifo);
+        if (hasMethod(methodBit(CbMethod::Lofo)))
+            func(mLofo);
+    }
+
+    // Engines allocate from their own memory context
+    template<typename Engine, typename Func>
+    void withEngine(Engine& engine, Func&& func)
+    {
+        MemoryContext oldContext = MemoryContextSwitchTo(engine.memoryContext());
+        func();
+        MemoryContextSwitchTo(oldContext);
+    }
+};
+
+// IMPORTANT: If this fails, change the expected size and adjust(!!!) pg_cost_basis--1.0.sql
+static_assert(sizeof(CbMultiState) == 200);
+
+// Copy of an engine row as a state of its own type, null if the method is not selected
+template<typename Engine>
+Datum engineCopy(FunctionCallInfo fcinfo, const Engine CbMultiState::* engine, uint32_t bit)
+{
+    const CbMultiState* state = reinterpret_cast<CbMultiState*>(PG_GETARG_POINTER(0));
+    if (!state->hasMethod(bit))
+        PG_RETURN_NULL();
+
+    PG_RETURN_POINTER(new (palloc(sizeof(Engine))) Engine(state->*engine));
+}
+
+} // namespace {
+
+extern "C"
+{
+
+PG_FUNCTION_INFO_V1(CbMultiState_in);
+Datum CbMultiState_in(PG_FUNCTION_ARGS)
+{
+    CbMultiState* state = CbMultiState::newState();
+    PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(CbMultiState_out);
+Datum CbMultiState_out(PG_FUNCTION_ARGS)
+{
+    CbMultiState* state = reinterpret_cast<CbMultiState*>(PG_GETARG_POINTER(0));
+    PG_RETURN_CSTRING(state->toPstring());
+}
+
+PG_FUNCTION_INFO_V1(CbMulti_acb0);
+Datum CbMulti_acb0(PG_FUNCTION_ARGS)
+{
+    return engineCopy(fcinfo, &CbMultiState::mAcb0, ACB0_METHOD_BIT);
+}
+
+PG_FUNCTION_INFO_V1(CbMulti_acb);
+Datum CbMulti_acb(PG_FUNCTION_ARGS)
+{
+    return engineCopy(fcinfo, &CbMultiState::mAcb, methodBit(CbMethod::Acb));
+}
+
+PG_FUNCTION_INFO_V1(CbMulti_fifo);
+Datum CbMulti_fifo(PG_FUNCTION_ARGS)
+{
+    return engineCopy(fcinfo, &CbMultiState::mFifo, methodBit(CbMethod::Fifo));
+}
+
+PG_FUNCTION_INFO_V1(CbMulti_lifo);
+Datum CbMulti_lifo(PG_FUNCTION_ARGS)
+{
+    return engineCopy(fcinfo, &CbMultiState::mLifo, methodBit(CbMethod::Lifo));
+}
+
+PG_FUNCTION_INFO_V1(CbMulti_hifo);
+Datum CbMulti_hifo(PG_FUNCTION_ARGS)
+{
+    return engineCopy(fcinfo, &CbMultiState::mHifo, methodBit(CbMethod::Hifo));
+}
+
+PG_FUNCTION_INFO_V1(CbMulti_lofo);
+Datum CbMulti_lofo(PG_FUNCTION_ARGS)
+{
+    return engineCopy(fcinfo, &CbMultiState::mLofo, methodBit(CbMethod::Lofo));
+}
+
+PG_FUNCTION_INFO_V1(CbMulti_sfunc);
+Datum CbMulti_sfunc(PG_FUNCTION_ARGS)
+{
+    return commonSFunc<CbMultiState, text*, false, false, false, true>(fcinfo);
+}
+
+PG_FUNCTION_INFO_V1(CbMulti_sfunc_int4);
+Datum CbMulti_sfunc_int4(PG_FUNCTION_ARGS)
+{
+    return commonSFunc<CbMultiState, int32_t, false, false, false, true>(fcinfo);
+}
+
+PG_FUNCTION_INFO_V1(CbMulti_sfunc_int8);
+Datum CbMulti_sfunc_int8(PG_FUNCTION_ARGS)
+{
+    return commonSFunc<CbMultiState, int64_t, false, false, false, true>(fcinfo);
+}
+
+} // extern "C"
@@ -29,13 +29,15 @@ std::string cpp_name()
 // More on postgres' memory management and memory contexts here:
 // https://www.cybertec-postgresql.com/en/memory-context-for-postgresql-memory-management/
 
-// Default memory context is very short-lived. In order to keep containers alive between function calls we use CurTransactionContext
-// pallocHook/pfreeHook wrap MemoryContextAlloc(CurTransactionContext, ...) and help to debug allocations
+// Containers allocate from CurrentMemoryContext. Transition functions switch it to the memory context of the state
+// shared between rows (a child of the per-query context), so containers outlive the aggregate (window partition
+// or group) as long as emitted states may reference them and are released together with the query.
+// pallocHook/pfreeHook wrap MemoryContextAlloc(context, ...) and help to debug allocations
 
 template<typename T>
-[[nodiscard]] void* pallocHook(std::size_t n = 1)
+[[nodiscard]] void* pallocHook(std::size_t n = 1, MemoryContext context = CurrentMemoryContext)
 {
-    void* buffer = MemoryContextAlloc(CurTransactionContext, n * sizeof(T));
+    void* buffer = MemoryContextAlloc(context, n * sizeof(T));
 
     // palloc/MemoryContextAlloc uses postgres exception(long jumps) mechanism on failure.
     // We don't have to check for nullptr here.
@@ -94,3 +96,46 @@ bool operator!=(PgAllocator<T>, PgAllocator<T>)
 {
     return false;
 }
+
+// Allocator bound to a particular memory context.
+// Used for containers that have a dedicated context, e.g. lot queue buffers live in their own context under the shared state.
+template<typename T>
+struct PgContextAllocator
+{
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    explicit PgContextAllocator(MemoryContext context) noexcept
+        : mContext(context)
+    {}
+
+    template<typename U> PgContextAllocator(const PgContextAllocator<U>& other) noexcept
+        : mContext(other.mContext)
+    {}
+
+    [[nodiscard]] value_type* allocate(std::size_t n) const noexcept
+    {
+        return static_cast<value_type*>(pallocHook<value_type>(n, mContext));
+    }
+
+    void deallocate(value_type* p, std::size_t n) const noexcept
+    {
+        pfreeHook<value_type>(p, n);
+    }
+
+    MemoryContext mContext;
+};
+
+template<typename T, typename U>
+bool operator==(const PgContextAllocator<T>& a, const PgContextAllocator<U>& b)
+{
+    return a.mContext == b.mContext;
+}
+
+template<typename T, typename U>
+bool operator!=(const PgContextAllocator<T>& a, const PgContextAllocator<U>& b)
+{
+    return a.mContext != b.mContext;
+}
@@ -1,4 +1,24 @@
 #include <postgres.h>
 #include <fmgr.h>
+#include <utils/guc.h>
 
 PG_MODULE_MAGIC;
+
+// Phases of the transition functions are timed while it's on, see profile.h
+bool cb_track_timing = false;
+
+void _PG_init(void);
+
+void _PG_init(void)
+{
+    DefineCustomBoolVariable("pg_cost_basis.track_timing",
+                             "Collects time spent in the phases of the cost basis transition functions.",
+                             "Results of the current backend are returned by cb_profile().",
+                             &cb_track_timing,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    MarkGUCPrefixReserved("pg_cost_basis");
+}
@@ -0,0 +1,39 @@
+#include "common.h"
+#include "profile.h"
+
+extern "C"
+{
+#include <funcapi.h>
+#include <utils/builtins.h>
+#include <utils/tuplestore.h>
+
+PG_FUNCTION_INFO_V1(CbProfile);
+Datum CbProfile(PG_FUNCTION_ARGS)
+{
+    InitMaterializedSRF(fcinfo, 0);
+    ReturnSetInfo* rsinfo = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+
+    for (int phase = 0; phase < CB_NUM_PHASES; ++phase)
+    {
+        const CbPhaseCounters& counters = gCbProfile[phase];
+        Datum values[4] = {
+            CStringGetTextDatum(CB_PHASE_NAMES[phase]),
+            Int64GetDatum(static_cast<int64_t>(counters.mCalls)),
+            Int64GetDatum(static_cast<int64_t>(counters.mCycles)),
+            Float8GetDatum(counters.mCalls != 0 ? static_cast<double>(counters.mCycles) / static_cast<double>(counters.mCalls) : 0.0),
+        };
+        bool nulls[4] = {false, false, false, false};
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+    return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(CbProfile_reset);
+Datum CbProfile_reset(PG_FUNCTION_ARGS)
+{
+    for (CbPhaseCounters& counters : gCbProfile)
+        counters = CbPhaseCounters{};
+    PG_RETURN_VOID();
+}
+
+}
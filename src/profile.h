@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Value of pg_cost_basis.track_timing, the GUC is defined in _PG_init
+extern "C" bool cb_track_timing;
+
+// Phases of the transition functions timed while pg_cost_basis.track_timing is on, see cb_profile().
+// Row spans a whole transition function call, the other phases are nested in it, except Accessors.
+// A row can enter a phase more than once, calls count the entries.
+enum class CbPhase : uint8_t
+{
+    Row,
+    // Argument checks, detoasting of the snapshot, account names and transfer_id, beginRow
+    Arguments,
+    // Interning account names or keys in the account dictionary
+    AccountLookup,
+    // Matching transfers and moving lots or entries between accounts
+    Transfers,
+    // Matching sells against lots or the average cost basis
+    Realize,
+    // Accessors that build arrays, records or jsonb out of a state
+    Accessors,
+};
+
+inline constexpr int CB_NUM_PHASES = static_cast<int>(CbPhase::Accessors) + 1;
+
+inline constexpr const char* CB_PHASE_NAMES[CB_NUM_PHASES] = {
+    "row",
+    "arguments",
+    "account_lookup",
+    "transfers",
+    "realize",
+    "accessors",
+};
+
+struct CbPhaseCounters
+{
+    uint64_t mCalls = 0;
+    uint64_t mCycles = 0;
+};
+
+// Counters of the current backend, cumulative until cb_profile_reset()
+inline CbPhaseCounters gCbProfile[CB_NUM_PHASES];
+
+// Time stamp counter where the CPU has one, a monotonic clock in nanoseconds elsewhere
+[[nodiscard]] inline uint64_t cbReadCycles() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+// Adds the cycles of its scope to the phase. With timing off it costs a load and a branch on construction
+// and destruction. Scopes left by ereport(ERROR) are not counted.
+class CbPhaseTimer
+{
+public:
+    explicit CbPhaseTimer(CbPhase phase) noexcept
+        : mPhase(phase)
+    {
+        if (cb_track_timing) [[unlikely]]
+        {
+            mTracking = true;
+            mStart = cbReadCycles();
+        }
+    }
+
+    ~CbPhaseTimer()
+    {
+        stop();
+    }
+
+    // End the phase before the end of the scope
+    void stop() noexcept
+    {
+        if (mTracking) [[unlikely]]
+        {
+            CbPhaseCounters& counters = gCbProfile[static_cast<int>(mPhase)];
+            ++counters.mCalls;
+            counters.mCycles += cbReadCycles() - mStart;
+            mTracking = false;
+        }
+    }
+
+    CbPhaseTimer(const CbPhaseTimer&) = delete;
+    CbPhaseTimer& operator=(const CbPhaseTimer&) = delete;
+
+private:
+    CbPhase mPhase;
+    bool mTracking = false;
+    uint64_t mStart = 0;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "common.h"
+#include "sfunc.h"
+
+extern "C"
+{
+#include <catalog/pg_type_d.h>
+#include <executor/spi.h>
+#include <funcapi.h>
+#include <utils/builtins.h>
+#include <utils/tuplestore.h>
+}
+
+// Bulk runners: cb_*_run(query) executes the query, feeds its rows to a fresh cost basis state in one pass and
+// returns a row of outputs per input row.
+//
+// The query must return (account, source_or_destination_account, price, amount, tag, ignore_transfer, transfer_id)
+// of the same types as the arguments of the aggregates, accounts are text, int or bigint. Rows are processed in
+// the order the query returns them, so it should be ordered by tag. Rows are fetched from a cursor in batches,
+// there is no window aggregate and no function call per row and per output column.
+
+// Number of rows fetched from the cursor at once
+static constexpr const long RUN_BATCH_SIZE = 10000;
+
+// Number of columns of the query and of transition function arguments, the state is argument 0
+static constexpr const int RUN_QUERY_COLUMNS = 7;
+
+inline void checkRunQueryColumns(TupleDesc tupleDesc)
+{
+    if (tupleDesc->natts != RUN_QUERY_COLUMNS) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("query must return %d columns (account, source_or_destination_account, price, amount, tag, ignore_transfer, transfer_id), got %d",
+                        RUN_QUERY_COLUMNS, tupleDesc->natts)));
+    }
+
+    Oid accountType = SPI_gettypeid(tupleDesc, 1);
+    if (accountType != TEXTOID && accountType != INT4OID && accountType != INT8OID) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("account column must be text, int or bigint, got %s", format_type_be(accountType))));
+    }
+
+    const Oid expectedTypes[RUN_QUERY_COLUMNS] = {accountType, accountType, FLOAT8OID, FLOAT8OID, INT8OID, BOOLOID, TEXTOID};
+    for (int column = 1; column <= RUN_QUERY_COLUMNS; ++column)
+    {
+        Oid type = SPI_gettypeid(tupleDesc, column);
+        if (type != expectedTypes[column - 1]) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATATYPE_MISMATCH),
+                     errmsg("column %d of the query must be %s, got %s",
+                            column, format_type_be(expectedTypes[column - 1]), format_type_be(type))));
+        }
+    }
+}
+
+// Process the rows of the already fetched batch and of the rest of the cursor
+template<typename CostBasisState, typename AccountArg, int NumColumns, typename EmitRow>
+void runPortal(Portal portal, CostBasisState* state, MemoryContext runContext, ReturnSetInfo* rsinfo, EmitRow& emitRow)
+{
+    // Row is passed to applyRow as arguments of the transition function without prev_tag
+    LOCAL_FCINFO(rowArgs, RUN_QUERY_COLUMNS + 1);
+    InitFunctionCallInfoData(*rowArgs, nullptr, RUN_QUERY_COLUMNS + 1, InvalidOid, nullptr, nullptr);
+    const CbSFuncArgs args = CbSFuncArgs::make(rowArgs, false, false, false);
+
+    // Output values, e.g. realized tags arrays, are released after every row
+    MemoryContext rowContext = AllocSetContextCreate(runContext, "pg_cost_basis run row", ALLOCSET_SMALL_SIZES);
+
+    for (;;)
+    {
+        SPITupleTable* tuptable = SPI_tuptable;
+        uint64 numRows = SPI_processed;
+
+        for (uint64 i = 0; i < numRows; ++i)
+        {
+            for (int column = 1; column <= RUN_QUERY_COLUMNS; ++column)
+            {
+                NullableDatum& arg = rowArgs->args[column];
+                arg.value = SPI_getbinval(tuptable->vals[i], tuptable->tupdesc, column, &arg.isnull);
+            }
+
+            if (rowArgs->args[args.mTag].isnull) [[unlikely]]
+            {
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("tag is null")));
+            }
+            int64_t tag = DatumGetInt64(rowArgs->args[args.mTag].value);
+
+            // One partition, realized entries of a row are consumed before the next one.
+            // The shared state is created in the run context, no state escapes the run, it is validated below.
+            state->beginRow(runContext, nullptr, false, false, nullptr);
+            MemoryContext oldContext = MemoryContextSwitchTo(state->memoryContext());
+            applyRow<CostBasisState, AccountArg>(rowArgs, args, state, tag);
+            state->endRow();
+
+            MemoryContextSwitchTo(rowContext);
+            Datum values[NumColumns];
+            bool nulls[NumColumns] = {};
+            emitRow(*state, tag, values);
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+            MemoryContextSwitchTo(oldContext);
+            MemoryContextReset(rowContext);
+        }
+
+        SPI_freetuptable(tuptable);
+        if (numRows < static_cast<uint64>(RUN_BATCH_SIZE))
+            break;
+
+        SPI_cursor_fetch(portal, true, RUN_BATCH_SIZE);
+    }
+
+    MemoryContextDelete(rowContext);
+}
+
+// Set returning function body: runs the query given by argument 0 through a new state,
+// emitRow(state, tag, values) fills NumColumns output values of a row
+template<typename CostBasisState, int NumColumns, typename EmitRow>
+void commonRun(FunctionCallInfo fcinfo, EmitRow&& emitRow)
+{
+    char* query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+    InitMaterializedSRF(fcinfo, 0);
+    ReturnSetInfo* rsinfo = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+
+    // The state lives until the end of the run, SPI_connect switches to SPI memory that is released by SPI_finish
+    MemoryContext runContext = AllocSetContextCreate(rsinfo->econtext->ecxt_per_query_memory, "pg_cost_basis run", ALLOCSET_DEFAULT_SIZES);
+    MemoryContext oldContext = MemoryContextSwitchTo(runContext);
+    CostBasisState* state = CostBasisState::newState();
+    MemoryContextSwitchTo(oldContext);
+
+    if (SPI_connect() != SPI_OK_CONNECT) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("SPI_connect failed")));
+    }
+
+    Portal portal = SPI_cursor_open_with_args(nullptr, query, 0, nullptr, nullptr, nullptr, true, 0);
+    SPI_cursor_fetch(portal, true, RUN_BATCH_SIZE);
+    checkRunQueryColumns(SPI_tuptable->tupdesc);
+
+    switch (SPI_gettypeid(SPI_tuptable->tupdesc, 1))
+    {
+    case INT4OID:
+        runPortal<CostBasisState, int32_t, NumColumns>(portal, state, runContext, rsinfo, emitRow);
+        break;
+    case INT8OID:
+        runPortal<CostBasisState, int64_t, NumColumns>(portal, state, runContext, rsinfo, emitRow);
+        break;
+    default:
+        runPortal<CostBasisState, text*, NumColumns>(portal, state, runContext, rsinfo, emitRow);
+        break;
+    }
+
+    if (state->hasSharedState())
+        state->validateAtEnd();
+
+    SPI_cursor_close(portal);
+    SPI_finish();
+
+    MemoryContextDelete(runContext);
+}
@@ -1,105 +1,308 @@
 #pragma once
 
 #include "common.h"
+#include "accounts.h"
+#include "profile.h"
+
+#include <span>
+#include <type_traits>
 
 extern "C"
 {
 #include <postgres.h>
 #include <fmgr.h>
+#include <utils/array.h>
+}
+
+// Accounts are passed either by name (text) or by integer surrogate key (int32_t, int64_t)
+template<typename AccountArg>
+using CbAccountKey = std::conditional_t<std::is_same_v<AccountArg, text*>, std::string_view, int64_t>;
+
+// Name or key of the account argument, names are detoasted
+template<typename AccountArg>
+[[nodiscard]] CbAccountKey<AccountArg> accountKeyArg(FunctionCallInfo fcinfo, int argno)
+{
+    if constexpr (std::is_same_v<AccountArg, text*>)
+    {
+        text* name = PG_GETARG_TEXT_PP(argno);
+        return std::string_view{VARDATA_ANY(name), VARSIZE_ANY_EXHDR(name)};
+    }
+    else if constexpr (std::is_same_v<AccountArg, int32_t>)
+        return static_cast<int64_t>(PG_GETARG_INT32(argno));
+    else
+        return static_cast<int64_t>(PG_GETARG_INT64(argno));
+}
+
+// Account of the argument, CbAccountDictionary::npos for accounts that the dictionary doesn't have
+template<typename AccountArg>
+[[nodiscard]] AccountId findAccountArg(FunctionCallInfo fcinfo, int argno, const CbAccountDictionary& accounts)
+{
+    return accounts.find(accountKeyArg<AccountArg>(fcinfo, argno));
+}
+
+// Position of portfolio aggregates, returns CbAccountDictionary::npos for unknown positions
+template<typename AccountArg>
+[[nodiscard]] AccountId findPositionArg(FunctionCallInfo fcinfo, int assetArgno, int accountArgno, const CbAccountDictionary& accounts)
+{
+    return accounts.findPosition(accountKeyArg<AccountArg>(fcinfo, assetArgno), accountKeyArg<AccountArg>(fcinfo, accountArgno));
+}
+
+// Argument numbers of the transition function, -1 for arguments that the aggregate doesn't have:
+// (state, [methods,] [snapshot,] [asset,] account, source_or_destination_account, price, amount, tag, [prev_tag | lot_tags,] ignore_transfer, transfer_id)
+// methods is the first argument of cb_multi, snapshot is the first argument of resumable aggregates,
+// asset is the first argument of portfolio aggregates, lot_tags is an argument of aggregates with lot selection.
+struct CbSFuncArgs
+{
+    int mMethods = -1;
+    int mSnapshot = -1;
+    int mAsset = -1;
+    int mAccount = -1;
+    int mSourceOrDestination = -1;
+    int mPrice = -1;
+    int mAmount = -1;
+    int mTag = -1;
+    int mPrevTag = -1;
+    int mLotTags = -1;
+    int mIgnoreTransfer = -1;
+    int mTransferId = -1;
+
+    [[nodiscard]] static CbSFuncArgs make(FunctionCallInfo fcinfo, bool portfolio, bool resumable, bool lotSelection, bool multi = false) noexcept
+    {
+        CbSFuncArgs args;
+        int argno = 1;
+        if (multi)
+            args.mMethods = argno++;
+        if (resumable)
+            args.mSnapshot = argno++;
+        if (portfolio)
+            args.mAsset = argno++;
+        args.mAccount = argno++;
+        args.mSourceOrDestination = argno++;
+        args.mPrice = argno++;
+        args.mAmount = argno++;
+        args.mTag = argno++;
+        // prev_tag is optional in plain aggregates, aggregates declared without it have one argument less
+        if (lotSelection)
+            args.mLotTags = argno++;
+        else if (!portfolio && !resumable && !multi && PG_NARGS() == 9)
+            args.mPrevTag = argno++;
+        args.mIgnoreTransfer = argno++;
+        args.mTransferId = argno++;
+        return args;
+    }
+};
+
+// Portfolio aggregates keep lots per (asset, account) position, the engines see positions as accounts.
+// Detoasting the names is timed as arguments, interning them as account lookup.
+template<typename AccountArg>
+[[nodiscard]] AccountId internPositionArg(FunctionCallInfo fcinfo, const CbSFuncArgs& args, int argno, CbAccountDictionary& accounts)
+{
+    CbPhaseTimer argumentsTimer(CbPhase::Arguments);
+    CbAccountKey<AccountArg> accountKey = accountKeyArg<AccountArg>(fcinfo, argno);
+    CbAccountKey<AccountArg> assetKey{};
+    if (args.mAsset >= 0)
+        assetKey = accountKeyArg<AccountArg>(fcinfo, args.mAsset);
+    argumentsTimer.stop();
+
+    CbPhaseTimer timer(CbPhase::AccountLookup);
+
+    AccountId account = accounts.intern(accountKey);
+    if (args.mAsset < 0)
+        return account;
+
+    AccountId asset = accounts.intern(assetKey);
+    return accounts.internPosition(asset, account);
 }
 
+// Select the lots of lot_tags for a row that disposes of lots of the account. Null or empty lot_tags, and rows that
+// add to the position of the account, leave the default matching order.
 template<typename CostBasisState>
-Datum commonSFunc(PG_FUNCTION_ARGS)
+void selectLotsArg(FunctionCallInfo fcinfo, const CbSFuncArgs& args, CostBasisState* state, AccountId account, double amount, int64_t tag)
 {
-    if (PG_ARGISNULL(5)) [[unlikely]]
+    if (PG_ARGISNULL(args.mLotTags) || !state->disposes(account, amount))
+        return;
+
+    ArrayType* lotTags = PG_GETARG_ARRAYTYPE_P(args.mLotTags);
+    if (ARR_NDIM(lotTags) > 1 || ARR_HASNULL(lotTags)) [[unlikely]]
     {
         ereport(ERROR,
                 (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                 errmsg("tag is null")));
+                 errmsg("tag %lu: lot_tags must be a one-dimensional array without nulls", tag)));
     }
-    int64_t tag = PG_GETARG_INT64(5);
 
-    if (PG_ARGISNULL(0)) [[unlikely]]
+    int numTags = ArrayGetNItems(ARR_NDIM(lotTags), ARR_DIMS(lotTags));
+    state->selectLots(account, std::span<const int64_t>{reinterpret_cast<const int64_t*>(ARR_DATA_PTR(lotTags)), static_cast<size_t>(numTags)}, tag);
+
+    // The row runs in the memory context of the state, a detoasted copy would stay there. The selection refers to
+    // the lots, not to the array.
+    PG_FREE_IF_COPY(lotTags, args.mLotTags);
+}
+
+// Process one row: account, amount, price and transfer arguments are read from fcinfo at positions given by args.
+// Used by the transition functions and by the bulk runners, which fill fcinfo from query results.
+// The caller brackets it with beginRow/endRow and runs it in the memory context of the state.
+template<typename CostBasisState, typename AccountArg, bool LotSelection = false>
+void applyRow(FunctionCallInfo fcinfo, const CbSFuncArgs& args, CostBasisState* state, int64_t tag)
+{
+    if (args.mAsset >= 0 && PG_ARGISNULL(args.mAsset)) [[unlikely]]
     {
         ereport(ERROR,
                 (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                 errmsg("tag %lu: state can't be null", tag)));
+                 errmsg("tag %lu: asset can't be null", tag)));
     }
-    CostBasisState* state = reinterpret_cast<CostBasisState*>(PG_GETARG_POINTER(0));
 
-    if (PG_ARGISNULL(1)) [[unlikely]]
+    if (PG_ARGISNULL(args.mAccount)) [[unlikely]]
     {
         ereport(ERROR,
                 (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                  errmsg("tag %lu: account can't be null", tag)));
     }
-    PgString account = textToString<PgString>(PG_GETARG_TEXT_PP(1));
+    AccountId account = internPositionArg<AccountArg>(fcinfo, args, args.mAccount, state->accounts());
 
-    if (PG_ARGISNULL(4)) [[unlikely]]
+    if (PG_ARGISNULL(args.mAmount)) [[unlikely]]
     {
         ereport(ERROR,
                 (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                  errmsg("tag %lu: amount can't be null null", tag)));
     }
-    double amount = PG_GETARG_FLOAT8(4);
-
-    // Reset the state when there is no previous tag in the group
-    // I was very surprised to learn that
-    // cb_fifo(...) over (partition by ... order by tag)
-    // doesn't create a new aggregate for each partition, but just tries to re-use state from previous partition
-    // This helps to detect that we begin with a new partition.
-    if (PG_ARGISNULL(6)) [[unlikely]]
-    {
-        state->validateAtEnd();
-        state = CostBasisState::newState();
-    }
-
-    CostBasisState* newState;
+    double amount = PG_GETARG_FLOAT8(args.mAmount);
 
     // if source_or_destination defined then it is a transfer
 
-    if (PG_ARGISNULL(2)) [[likely]]
+    if (PG_ARGISNULL(args.mSourceOrDestination)) [[likely]]
     {
-        if (PG_ARGISNULL(3)) [[unlikely]]
+        if (PG_ARGISNULL(args.mPrice)) [[unlikely]]
         {
             ereport(ERROR,
                     (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                      errmsg("tag %lu: price can't be null", tag)));
         }
-        double price = PG_GETARG_FLOAT8(3);
+        double price = PG_GETARG_FLOAT8(args.mPrice);
 
-        newState = state->realize(account, price, amount, tag);
+        if constexpr (LotSelection)
+            selectLotsArg(fcinfo, args, state, account, amount, tag);
+
+        CbPhaseTimer timer(CbPhase::Realize);
+        state->realize(account, price, amount, tag);
     }
     else
     {
         bool ignoreTransfer = false;
-        if (!PG_ARGISNULL(7))
-            ignoreTransfer = PG_GETARG_BOOL(7);
+        if (!PG_ARGISNULL(args.mIgnoreTransfer))
+            ignoreTransfer = PG_GETARG_BOOL(args.mIgnoreTransfer);
 
         std::optional<double> price;
-        if (!PG_ARGISNULL(3))
-            price = PG_GETARG_FLOAT8(3);
+        if (!PG_ARGISNULL(args.mPrice))
+            price = PG_GETARG_FLOAT8(args.mPrice);
 
-        if (ignoreTransfer)
-            newState = CostBasisState::newState(state);
-        else
+        // Ignored transfers leave the state as it was reset by beginRow
+        if (!ignoreTransfer)
         {
-            std::optional<PgString> transferId;
-            if (!PG_ARGISNULL(8))
-                transferId = textToString<PgString>(PG_GETARG_TEXT_PP(8));
+            std::optional<std::string_view> transferId;
+            if (!PG_ARGISNULL(args.mTransferId))
+            {
+                CbPhaseTimer timer(CbPhase::Arguments);
+                text* transferIdText = PG_GETARG_TEXT_PP(args.mTransferId);
+                transferId = std::string_view{VARDATA_ANY(transferIdText), VARSIZE_ANY_EXHDR(transferIdText)};
+            }
 
+            // Transfers move an asset between accounts, the other side is a position of the same asset
             if (amount < 0)
             {
-                PgString destinationAccount = textToString<PgString>(PG_GETARG_TEXT_PP(2));
-                newState = state->initiateTransfer(account, destinationAccount, transferId, amount, price, tag);
+                AccountId destinationAccount = internPositionArg<AccountArg>(fcinfo, args, args.mSourceOrDestination, state->accounts());
+
+                if constexpr (LotSelection)
+                    selectLotsArg(fcinfo, args, state, account, amount, tag);
+
+                CbPhaseTimer timer(CbPhase::Transfers);
+                state->initiateTransfer(account, destinationAccount, transferId, amount, price, tag);
             }
             else
             {
-                PgString sourceAccount = textToString<PgString>(PG_GETARG_TEXT_PP(2));
-                newState = state->finalizeTransfer(account, sourceAccount, transferId, amount, tag);
+                AccountId sourceAccount = internPositionArg<AccountArg>(fcinfo, args, args.mSourceOrDestination, state->accounts());
+                CbPhaseTimer timer(CbPhase::Transfers);
+                state->finalizeTransfer(account, sourceAccount, transferId, amount, tag);
             }
         }
     }
+}
+
+// Scoped aggregates only pass their state to a final function, which runs before the aggregate context is reset,
+// so their shared state can live and go in the aggregate context
+template<typename CostBasisState, typename AccountArg = text*, bool Portfolio = false, bool Resumable = false, bool LotSelection = false, bool Multi = false, bool Scoped = false>
+Datum commonSFunc(PG_FUNCTION_ARGS)
+{
+    CbPhaseTimer rowTimer(CbPhase::Row);
+    CbPhaseTimer argumentsTimer(CbPhase::Arguments);
+
+    const CbSFuncArgs args = CbSFuncArgs::make(fcinfo, Portfolio, Resumable, LotSelection, Multi);
+
+    if (PG_ARGISNULL(args.mTag)) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("tag is null")));
+    }
+    int64_t tag = PG_GETARG_INT64(args.mTag);
+
+    if (PG_ARGISNULL(0)) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("tag %lu: state can't be null", tag)));
+    }
+    CostBasisState* state = reinterpret_cast<CostBasisState*>(PG_GETARG_POINTER(0));
+
+    // The state is modified in place, this is only allowed when postgres passes us the transition value
+    // that lives in the aggregate context.
+    MemoryContext aggContext = nullptr;
+    int aggKind = AggCheckCallContext(fcinfo, &aggContext);
+    if (aggKind == 0) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("tag %lu: cost basis transition function called in non-aggregate context", tag)));
+    }
+
+    // Every aggregate (window partition or group) starts from a copy of initcond which has no shared state yet,
+    // beginRow creates it then. That is how a new partition is detected, prev_tag is not needed.
+    // Emitted states must stay readable after the aggregate context is reset for the next partition or group,
+    // so the shared state is created in the per-query context, fn_mcxt of the transition function, and window
+    // functions keep the realized entries of all rows. Scoped aggregates create it in the aggregate context.
+    // For compatibility, null prev_tag still resets the shared state.
+    // Resumable aggregates restore the new shared state from the snapshot, it is detoasted only then.
+    const bytea* snapshot = nullptr;
+    if (args.mSnapshot >= 0 && !state->hasSharedState() && !PG_ARGISNULL(args.mSnapshot))
+        snapshot = PG_GETARG_BYTEA_PP(args.mSnapshot);
+
+    // Methods of cb_multi are fixed by the first row of the aggregate, beginRow creates their engines
+    if constexpr (Multi)
+    {
+        if (PG_ARGISNULL(args.mMethods)) [[unlikely]]
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("tag %lu: methods can't be null", tag)));
+        }
+        state->selectMethods(static_cast<uint32_t>(PG_GETARG_INT32(args.mMethods)), tag);
+    }
+
+    MemoryContext sharedParent = Scoped ? aggContext : fcinfo->flinfo->fn_mcxt;
+    bool keepRealized = !Scoped && aggKind == AGG_CONTEXT_WINDOW;
+    // The shared state is validated when the aggregate is done, scoped aggregates leave it to the final function
+    MemoryContext validationContext = Scoped ? nullptr : aggContext;
+    state->beginRow(sharedParent, validationContext, args.mPrevTag >= 0 && PG_ARGISNULL(args.mPrevTag), keepRealized, snapshot);
+    argumentsTimer.stop();
+
+    // Everything allocated while processing the row must survive until the next row
+    MemoryContext oldContext = MemoryContextSwitchTo(state->memoryContext());
+
+    applyRow<CostBasisState, AccountArg, LotSelection>(fcinfo, args, state, tag);
+
+    state->endRow();
+
+    MemoryContextSwitchTo(oldContext);
 
-    PG_RETURN_POINTER(newState);
+    // Returning the same pointer tells the executor that there is nothing to copy
+    PG_RETURN_POINTER(state);
 }
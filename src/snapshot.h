@@ -0,0 +1,91 @@
+#pragma once
+
+#include "common.h"
+
+#include <string_view>
+
+extern "C"
+{
+#include <lib/stringinfo.h>
+#include <libpq/pqformat.h>
+}
+
+// Binary format of cost basis states, written by cb_*_snapshot and read by resumable aggregates.
+// The state types have no send/recv functions: a state datum points to its shared state, a fixed length datum can't
+// carry the book, and a state received from a client would point to a shared state nobody releases.
+//
+// header: uint32 magic, uint8 version, uint8 method
+// book:   uint8 present flag (the initial state has no book), then method specific: accounts, lots, pending transfers
+// row:    method specific, output values of the last processed row, resumable aggregates only restore the book
+//
+// Integers and floats are written with pqformat, i.e. in network byte order. Reading uses pq_getmsg* functions which
+// report an error instead of reading past the end of a truncated snapshot.
+
+static constexpr const uint32_t SNAPSHOT_MAGIC = 0x43425331; // "CBS1"
+static constexpr const uint8_t SNAPSHOT_VERSION = 1;
+
+inline void writeSnapshotHeader(StringInfo buf, CbMethod method)
+{
+    pq_sendint32(buf, SNAPSHOT_MAGIC);
+    pq_sendbyte(buf, SNAPSHOT_VERSION);
+    pq_sendbyte(buf, static_cast<uint8_t>(method));
+}
+
+inline void readSnapshotHeader(StringInfo buf, CbMethod method)
+{
+    uint32_t magic = pq_getmsgint(buf, 4);
+    uint8_t version = pq_getmsgbyte(buf);
+    uint8_t snapshotMethod = pq_getmsgbyte(buf);
+
+    if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("invalid cost basis snapshot: unknown format or version %u", version)));
+    }
+
+    if (snapshotMethod != static_cast<uint8_t>(method)) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("cost basis snapshot of method %u can't be used with method %u",
+                        snapshotMethod, static_cast<uint8_t>(method))));
+    }
+}
+
+// Read-only view of a snapshot passed as bytea
+[[nodiscard]] inline StringInfoData snapshotReader(const bytea* snapshot)
+{
+    StringInfoData buf;
+    buf.data = const_cast<char*>(VARDATA_ANY(snapshot));
+    buf.len = static_cast<int>(VARSIZE_ANY_EXHDR(snapshot));
+    buf.maxlen = buf.len;
+    buf.cursor = 0;
+    return buf;
+}
+
+inline void writeString(StringInfo buf, std::string_view s)
+{
+    pq_sendint32(buf, static_cast<uint32_t>(s.size()));
+    pq_sendbytes(buf, s.data(), static_cast<int>(s.size()));
+}
+
+[[nodiscard]] inline std::string_view readString(StringInfo buf)
+{
+    int len = static_cast<int>(pq_getmsgint(buf, 4));
+    return std::string_view{pq_getmsgbytes(buf, len), static_cast<size_t>(len)};
+}
+
+// Counts are validated against the remaining size so a corrupted count can't trigger a huge allocation
+[[nodiscard]] inline uint32_t readCount(StringInfo buf, size_t minElementSize)
+{
+    uint32_t count = pq_getmsgint(buf, 4);
+    if (count * minElementSize > static_cast<size_t>(buf->len - buf->cursor)) [[unlikely]]
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("invalid cost basis snapshot: %u elements don't fit into the remaining %d bytes",
+                        count, buf->len - buf->cursor)));
+    }
+    return count;
+}
@@ -0,0 +1,8 @@
+#include "lot_policies.h"
+
+extern "C"
+{
+
+CB_LOT_METHOD_FUNCTIONS(SpecId, true)
+
+}
@@ -0,0 +1,34 @@
+-- The state of a group points to the state shared by the group. It must stay readable after a sorted aggregate
+-- moves on to the next group, e.g. when groups are ordered by something else than the grouping key.
+CREATE TABLE trades (a text, account text, price float, amount float, tag bigint);
+INSERT INTO trades VALUES
+    ('x', 'p', 10, 2, 1),
+    ('y', 'q', 100, 1, 2),
+    ('x', 'p', 12, 1, 3),
+    ('y', 'q', 90, -1, 4),
+    ('x', 'p', 15, -2.5, 5),
+    ('y', 'r', 50, 3, 6),
+    ('z', 'p', 1, 4, 7),
+    ('z', 'p', 2, -1, 8);
+-- Groups are aggregated in the order of a, sorted by last_tag afterwards
+SET enable_hashagg = off;
+SELECT a, last_tag, s, cb_fifo_capital_gain(s) AS capital_gain, cb_fifo_balance(s) AS balance, (cb_fifo_stats(s)).rows
+FROM (
+    SELECT a, max(tag) AS last_tag, cb_fifo(account, NULL::text, price, amount, tag, NULL::bool, NULL::text ORDER BY tag) s
+    FROM trades
+    GROUP BY a
+    ORDER BY last_tag DESC
+    OFFSET 0
+) g
+ORDER BY last_tag DESC;
+SELECT a, last_tag, (cb_acb_stats(s)).rows, (cb_acb_stats(s)).accounts
+FROM (
+    SELECT a, max(tag) AS last_tag, cb_acb(account, NULL::text, price, amount, tag, NULL::bool, NULL::text ORDER BY tag) s
+    FROM trades
+    GROUP BY a
+    ORDER BY last_tag DESC
+    OFFSET 0
+) g
+ORDER BY last_tag DESC;
+RESET enable_hashagg;
+DROP TABLE trades;
@@ -0,0 +1,29 @@
+-- Snapshots round trip: resuming from the snapshot of the first rows and processing the rest gives the same book,
+-- and so the same snapshot, as processing all rows. The cut leaves a transfer pending.
+CREATE TABLE trades (account text, dest text, price float, amount float, tag bigint, transfer_id text);
+INSERT INTO trades VALUES
+    ('p', NULL, 10, 2, 1, NULL),
+    ('q', NULL, 12, 3, 2, NULL),
+    ('p', 'q', NULL, -1, 3, 't1'),
+    ('p', NULL, 15, -0.5, 4, NULL),
+    ('q', 'p', NULL, 1, 5, 't1'),
+    ('q', NULL, 20, -2, 6, NULL),
+    ('p', 'r', NULL, -0.5, 7, NULL),
+    ('r', 'p', NULL, 0.5, 8, NULL);
+CREATE TABLE fifo_head AS
+SELECT cb_fifo_snapshot(cb_fifo(account, dest, price, amount, tag, NULL::bool, transfer_id ORDER BY tag)) AS snapshot
+FROM trades
+WHERE tag <= 4;
+SELECT cb_fifo_snapshot(cb_fifo_resume((SELECT snapshot FROM fifo_head), account, dest, price, amount, tag, NULL::bool, transfer_id ORDER BY tag))
+       = (SELECT cb_fifo_snapshot(cb_fifo(account, dest, price, amount, tag, NULL::bool, transfer_id ORDER BY tag)) FROM trades) AS same_book
+FROM trades
+WHERE tag > 4;
+CREATE TABLE acb_head AS
+SELECT cb_acb_snapshot(cb_acb(account, dest, price, amount, tag, NULL::bool, transfer_id ORDER BY tag)) AS snapshot
+FROM trades
+WHERE tag <= 4;
+SELECT cb_acb_snapshot(cb_acb_resume((SELECT snapshot FROM acb_head), account, dest, price, amount, tag, NULL::bool, transfer_id ORDER BY tag))
+       = (SELECT cb_acb_snapshot(cb_acb(account, dest, price, amount, tag, NULL::bool, transfer_id ORDER BY tag)) FROM trades) AS same_book
+FROM trades
+WHERE tag > 4;
+DROP TABLE fifo_head, acb_head, trades;
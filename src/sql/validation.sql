@@ -0,0 +1,24 @@
+-- Unfinished transfers and remaining amounts are reported once when a partition or group is done,
+-- also by the aggregates declared without prev_tag
+CREATE TABLE transfers (a text, account text, dest text, price float, amount float, tag bigint);
+INSERT INTO transfers VALUES
+    ('x', 'p', NULL, 10, 2, 1),
+    ('x', 'p', 'q', NULL, -2, 2),
+    ('y', 'p', NULL, 20, 1, 3),
+    ('y', 'p', 'q', NULL, -1, 4),
+    ('y', 'q', 'p', NULL, 1, 5);
+SELECT tag, a, cb_fifo_capital_gain(cb_fifo(account, dest, price, amount, tag, NULL::bool, NULL::text) OVER (PARTITION BY a ORDER BY tag)) AS capital_gain
+FROM transfers
+ORDER BY tag;
+SET enable_hashagg = off;
+SELECT a, cb_acb_capital_gain(cb_acb(account, dest, price, amount, tag, NULL::bool, NULL::text ORDER BY tag)) AS capital_gain
+FROM transfers
+GROUP BY a
+ORDER BY a;
+-- Final functions report it themselves
+SELECT a, cb_fifo_total_gain(account, dest, price, amount, tag, NULL::bool, NULL::text ORDER BY tag) AS total_gain
+FROM transfers
+GROUP BY a
+ORDER BY a;
+RESET enable_hashagg;
+DROP TABLE transfers;
@@ -0,0 +1,34 @@
+-- States emitted by window functions point to the state shared by their partition. They must stay readable
+-- after the window moves on to the next partition, e.g. when the output is sorted across partitions.
+CREATE TABLE trades (a text, account text, price float, amount float, tag bigint);
+INSERT INTO trades VALUES
+    ('x', 'p', 10, 2, 1),
+    ('y', 'q', 100, 1, 2),
+    ('x', 'p', 12, 1, 3),
+    ('y', 'q', 90, -1, 4),
+    ('x', 'p', 15, -2.5, 5),
+    ('y', 'r', 50, 3, 6),
+    ('z', 'p', 1, 4, 7),
+    ('z', 'p', 2, -1, 8);
+-- States are printed after the sort
+SELECT tag, cb_fifo(account, NULL::text, price, amount, tag, NULL::bool, NULL::text) OVER (PARTITION BY a ORDER BY tag)
+FROM trades
+ORDER BY tag;
+-- Accessors are evaluated after the sort
+SELECT tag, a, cb_fifo_capital_gain(s) AS capital_gain, cb_fifo_realized_tags(s) AS realized_tags, (cb_fifo_stats(s)).rows
+FROM (
+    SELECT tag, a, cb_fifo(account, NULL::text, price, amount, tag, NULL::bool, NULL::text) OVER (PARTITION BY a ORDER BY tag) s
+    FROM trades
+    ORDER BY tag
+    OFFSET 0
+) w
+ORDER BY tag;
+SELECT tag, a, (cb_acb_stats(s)).rows, (cb_acb_stats(s)).accounts
+FROM (
+    SELECT tag, a, cb_acb(account, NULL::text, price, amount, tag, NULL::bool, NULL::text) OVER (PARTITION BY a ORDER BY tag) s
+    FROM trades
+    ORDER BY tag
+    OFFSET 0
+) w
+ORDER BY tag;
+DROP TABLE trades;
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+#include "snapshot.h"
+#include "core/transfers.h"
+
+// Pending transfers in snapshots, see CbPendingTransfers
+
+// Transfers are written in initiation order, writeEntry(buf, entry) writes one transferred entry
+template<typename AccountEntry, typename Allocator, typename WriteEntry>
+void writeTransfers(StringInfo buf, const CbPendingTransfers<AccountEntry, Allocator>& transfers, WriteEntry&& writeEntry)
+{
+    pq_sendint32(buf, static_cast<uint32_t>(transfers.size()));
+    transfers.forEach([buf, &writeEntry](const auto& transfer) {
+        pq_sendbyte(buf, transfer.mTransferId.has_value());
+        if (transfer.mTransferId.has_value())
+            writeString(buf, *transfer.mTransferId);
+        pq_sendint32(buf, transfer.mSourceAccount);
+        pq_sendint32(buf, transfer.mDestinationAccount);
+        pq_sendfloat8(buf, transfer.mAmount);
+        pq_sendint32(buf, static_cast<uint32_t>(transfer.mEntries.size()));
+        for (const AccountEntry& entry : transfer.mEntries)
+            writeEntry(buf, entry);
+    });
+}
+
+// readEntry(buf) returns one transferred entry
+template<typename AccountEntry, typename Allocator, typename ReadEntry>
+void readTransfers(StringInfo buf, CbPendingTransfers<AccountEntry, Allocator>& transfers, ReadEntry&& readEntry)
+{
+    for (uint32_t n = readCount(buf, 2 * sizeof(uint32_t) + sizeof(double)); n > 0; --n)
+    {
+        std::optional<std::string_view> transferId;
+        if (pq_getmsgbyte(buf) != 0)
+            transferId = readString(buf);
+        AccountId sourceAccount = pq_getmsgint(buf, 4);
+        AccountId destinationAccount = pq_getmsgint(buf, 4);
+        double amount = pq_getmsgfloat8(buf);
+
+        auto transfer = transfers.newTransfer(transferId, sourceAccount, destinationAccount, amount);
+        uint32_t numEntries = readCount(buf, sizeof(double));
+        transfer.mEntries.reserve(numEntries);
+        for (uint32_t i = 0; i < numEntries; ++i)
+            transfer.mEntries.push_back(readEntry(buf));
+
+        transfers.push(std::move(transfer));
+    }
+}